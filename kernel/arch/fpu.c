@@ -0,0 +1,265 @@
+#include <kernel.h>
+#include <string.h>
+#include <io.h>
+
+/*
+ * The x87/SSE registers are switched lazily. A task switch only sets CR0.TS. The first
+ * FPU or SSE instruction after that raises #NM (int 7), and only then are the registers
+ * of the last owner saved and the new task's loaded. Tasks that never touch the FPU
+ * never pay for it. Interrupt handlers must not use the FPU at all.
+ *
+ * Each cpu has its own registers and its own owner. With more than one cpu online a task
+ * may pick its registers up somewhere else next time, so they are saved to memory when it
+ * is switched out. Loading them is still left to the trap.
+ */
+
+#define CR0_MP  (1 << 1)    // Monitor coprocessor. WAIT/FWAIT trap too while TS is set.
+#define CR0_EM  (1 << 2)    // Emulation. Every FPU instruction traps.
+#define CR0_TS  (1 << 3)    // Task switched. The next FPU/SSE instruction traps.
+#define CR0_NE  (1 << 5)    // Report FPU errors as #MF instead of through the PIC.
+
+#define CR4_OSFXSR      (1 << 9)    // We save state with FXSAVE. Enables SSE.
+#define CR4_OSXMMEXCPT  (1 << 10)   // We handle SIMD exceptions (#XM).
+
+// CPUID.01h:EDX feature bits.
+#define CPUID_FEATURE_FPU   (1 << 0)
+#define CPUID_FEATURE_FXSR  (1 << 24)
+#define CPUID_FEATURE_SSE   (1 << 25)
+
+// FXSAVE wants 512 bytes on a 16 byte boundary. FSAVE needs 108 of them.
+// Slab objects are only 8 byte aligned, so each area carries room to align itself.
+#define FPU_STATE_SIZE      512
+#define FPU_STATE_ALIGN     16
+
+// The power-on value of MXCSR. All SIMD exceptions masked, round to nearest.
+#define FPU_MXCSR_DEFAULT   0x1F80
+
+static uint8_t fpu_present;
+static uint8_t fpu_has_fxsr;
+
+// The task whose registers are in each cpu's FPU right now. NULL = nobody's.
+static struct task* volatile fpu_owner[SMP_MAX_CPUS];
+
+// Save areas are handed out when a task is created, where running out can be reported.
+// The trap runs with interrupts off and must not allocate.
+static slab_cache_t* fpu_cache;
+
+// A clean register image every task starts from.
+static uint8_t fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+// Traps taken, and how many of them had to save someone else's registers first.
+static uint32_t fpu_traps;
+static uint32_t fpu_saves;
+
+//========================================================================================
+/* Helper: Returns the 16 byte aligned save area inside a slab object. */
+static void* fpu_area(void* state)
+{
+    return((void*)(((uint32_t)state + (FPU_STATE_ALIGN - 1)) & ~(FPU_STATE_ALIGN - 1)));
+}
+
+//========================================================================================
+/* Helper: Saves the FPU registers. FSAVE also reinitializes the FPU. */
+static void fpu_save(void* area)
+{
+    if(fpu_has_fxsr) { asm volatile("fxsave (%0)" :: "r"(area) : "memory"); }
+    else             { asm volatile("fnsave (%0)" :: "r"(area) : "memory"); }
+}
+
+//========================================================================================
+/* Helper: Loads the FPU registers. */
+static void fpu_restore(void* area)
+{
+    if(fpu_has_fxsr) { asm volatile("fxrstor (%0)" :: "r"(area) : "memory"); }
+    else             { asm volatile("frstor (%0)" :: "r"(area) : "memory"); }
+}
+
+//========================================================================================
+/* Turns on the FPU, and SSE if the cpu has it, and arms the #NM trap. Needs the heap. */
+void fpu_init()
+{
+    fpu_present = 0;
+    fpu_has_fxsr = 0;
+    memset((void*)fpu_owner, 0, sizeof(fpu_owner));
+    fpu_traps = 0;
+    fpu_saves = 0;
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if(!(edx & CPUID_FEATURE_FPU)) { return; }
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" :: "r"(cr0));
+
+    if(edx & CPUID_FEATURE_FXSR)
+    {
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if(edx & CPUID_FEATURE_SSE) { cr4 |= CR4_OSXMMEXCPT; }
+        asm volatile("mov %0, %%cr4" :: "r"(cr4));
+        fpu_has_fxsr = 1;
+    }
+
+    // Take a snapshot of the clean state for new tasks.
+    asm volatile("fninit");
+    if(edx & CPUID_FEATURE_SSE)
+    {
+        uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+        asm volatile("ldmxcsr %0" :: "m"(mxcsr));
+    }
+    memset(fpu_initial_state, 0, sizeof(fpu_initial_state));
+    fpu_save(fpu_initial_state);
+
+    fpu_cache = slab_cache_create("fpu_state", FPU_STATE_SIZE + FPU_STATE_ALIGN, 4);
+    fpu_present = 1;
+
+    // Nobody owns the registers yet. The first one to use them takes the trap.
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS));
+}
+
+//========================================================================================
+/* Turns on the FPU of an application processor. CR4 already came from the boot cpu. */
+void fpu_init_ap()
+{
+    if(!fpu_present) { return; }
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" :: "r"(cr0));
+    asm volatile("fninit");
+
+    // Nobody owns this cpu's registers yet.
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS));
+}
+
+//========================================================================================
+/*
+ * Called by the scheduler on a task switch, with interrupts disabled.
+ * Arms the trap unless next owns the registers.
+ */
+void fpu_switch(struct task* prev, struct task* next)
+{
+    if(!fpu_present) { return; }
+
+    uint32_t cpu = smp_cpu_index();
+    if(smp_cpu_count > 1 && prev && prev == fpu_owner[cpu])
+    {
+        // The owner always runs with TS clear, so this can't trap.
+        fpu_save(fpu_area(prev->fpu_state));
+        fpu_saves++;
+
+        // FSAVE leaves the registers reinitialized. FXSAVE leaves them as they were.
+        if(!fpu_has_fxsr) { fpu_owner[cpu] = NULL; }
+    }
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    uint32_t want = (next == fpu_owner[cpu]) ? (cr0 & ~CR0_TS) : (cr0 | CR0_TS);
+    if(want != cr0)
+    {
+        asm volatile("mov %0, %%cr0" :: "r"(want));
+    }
+}
+
+//========================================================================================
+/*
+ * Handles #NM, the first FPU instruction after a task switch.
+ * Saves the registers of their last owner and loads the current task's.
+ * Returns 0 when the instruction can be retried, -1 if the fault is real.
+ */
+int fpu_handle_trap()
+{
+    if(!fpu_present) { return(-1); }
+
+    // Before tasking the boot code is the only one around.
+    struct task* task = task_current();
+    if(!task)
+    {
+        asm volatile("clts");
+        return(0);
+    }
+
+    // Every task got its save area from fpu_task_init().
+    if(!task->fpu_state) { return(-1); }
+    task->fpu_used = 1;
+
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+
+    asm volatile("clts");
+    fpu_traps++;
+    uint32_t cpu = smp_cpu_index();
+    struct task* owner = fpu_owner[cpu];
+    if(owner != task)
+    {
+        // With one cpu the owner's registers are only ever saved here.
+        if(owner && smp_cpu_count == 1)
+        {
+            fpu_save(fpu_area(owner->fpu_state));
+            fpu_saves++;
+        }
+        fpu_restore(fpu_area(task->fpu_state));
+        fpu_owner[cpu] = task;
+
+        // Whatever another cpu still holds of ours is stale now.
+        for(uint32_t i=0; i<SMP_MAX_CPUS; i++)
+        {
+            if(i != cpu) { __sync_bool_compare_and_swap(&fpu_owner[i], task, NULL); }
+        }
+    }
+
+    if(ints_enabled) { asm volatile("sti"); }
+    return(0);
+}
+
+//========================================================================================
+/*
+ * Gives a new task its save area, with a clean register image in it.
+ * Returns 0, or -1 if we are out of memory. Without an FPU there is nothing to save.
+ */
+int fpu_task_init(struct task* task)
+{
+    task->fpu_state = NULL;
+    if(!fpu_present) { return(0); }
+
+    void* state = slab_alloc(fpu_cache);
+    if(!state) { return(-1); }
+    memcpy(fpu_initial_state, fpu_area(state), FPU_STATE_SIZE);
+    task->fpu_state = state;
+    return(0);
+}
+
+//========================================================================================
+/* Drops the registers and the save area of a task that exited. */
+void fpu_task_exit(struct task* task)
+{
+    for(uint32_t i=0; i<SMP_MAX_CPUS; i++)
+    {
+        __sync_bool_compare_and_swap(&fpu_owner[i], task, NULL);
+    }
+
+    if(task->fpu_state)
+    {
+        slab_free(fpu_cache, task->fpu_state);
+        task->fpu_state = NULL;
+    }
+}
+
+//========================================================================================
+/* Displays what the FPU supports and how often it changed hands. */
+void fpu_display_stats()
+{
+    if(!fpu_present)
+    {
+        kprintf("fpu: none\n");
+        return;
+    }
+    kprintf("fpu: x87%s, %d traps, %d saves\n", fpu_has_fxsr ? " + fxsave/sse" : "", fpu_traps, fpu_saves);
+}
@@ -35,6 +35,12 @@ extern IRQ0_HANDLER
 extern IRQ1_HANDLER
 extern IRQ4_HANDLER
 extern IRQ14_HANDLER
+extern IRQ15_HANDLER
+extern YIELD_HANDLER
+extern LAPIC_TIMER_HANDLER
+extern RESCHED_HANDLER
+extern TLB_HANDLER
+extern SPURIOUS_HANDLER
 
 ;=============================================================================================
 
@@ -79,6 +85,37 @@ IDT_INIT:
     push dword IRQ14_HANDLER    ; Primary ATA
     call IDT_SET_GATE
     add esp, 8
+    ;
+    push dword 47
+    push dword IRQ15_HANDLER    ; Secondary ATA
+    call IDT_SET_GATE
+    add esp, 8
+    ;
+    push dword 48
+    push dword YIELD_HANDLER    ; task_yield() (TASK_YIELD_VECTOR)
+    call IDT_SET_GATE
+    add esp, 8
+    ;
+    ; The local APIC vectors (SMP_*_VECTOR).
+    push dword 49
+    push dword LAPIC_TIMER_HANDLER
+    call IDT_SET_GATE
+    add esp, 8
+    ;
+    push dword 50
+    push dword RESCHED_HANDLER
+    call IDT_SET_GATE
+    add esp, 8
+    ;
+    push dword 51
+    push dword TLB_HANDLER
+    call IDT_SET_GATE
+    add esp, 8
+    ;
+    push dword 255
+    push dword SPURIOUS_HANDLER
+    call IDT_SET_GATE
+    add esp, 8
 
     ret
 
@@ -90,6 +127,7 @@ IDT_INIT:
 IDT_SET_GATE:
     push ebp
     mov  ebp, esp
+    push ebx                ; Callee saved. C calls us too.
     mov  eax, [ebp + 12]    ; Get the interrupt number (arg 2)
     mov  ebx, [ebp + 8]     ; Get the handler address (arg 1)
     
@@ -105,6 +143,7 @@ IDT_SET_GATE:
     shr  ebx, 16                                    ; Shift high bits of address into low bits
     mov  [eax + IDT_ENTRY.offset_high], bx          ; Store them
 
+    pop  ebx
     pop  ebp
     ret
 
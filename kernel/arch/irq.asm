@@ -12,11 +12,24 @@ global IRQ1_HANDLER
 global IRQ0_HANDLER
 global IRQ4_HANDLER
 global IRQ14_HANDLER
+global IRQ15_HANDLER
+global IDE_NATIVE_IRQ_HANDLER
+global YIELD_HANDLER
+global LAPIC_TIMER_HANDLER
+global RESCHED_HANDLER
+global TLB_HANDLER
+global SPURIOUS_HANDLER
 
 extern keyboard_interrupt_handler
 extern timer_interrupt_handler
+extern smp_timer_interrupt_handler
+extern smp_resched_interrupt_handler
+extern smp_tlb_interrupt_handler
+extern smp_lapic_eoi
+extern task_switch_finish
 extern com1_interrupt_handler
 extern ide_interrupt_handler
+extern ide_native_irq
 
 ;=============================================================================================
 ;
@@ -71,9 +84,63 @@ IRQ0_HANDLER:
     mov  esp, eax       ; Load the new task's stack pointer into ESP.
     mov  al, 0x20       ; ACK the interrupt.
     out  0x20, al
+    call task_switch_finish         ; We are off the old task's stack. Other cpus may run it now.
     popa
     iret
 
+; This is the handler for the yield software interrupt (0x30), raised by task_yield().
+; It is the timer interrupt of whichever cpu we are on, without the hardware, so there is no interrupt to ACK.
+YIELD_HANDLER:
+    pusha
+    mov  eax, esp                   ; Get the current stack pointer
+    push eax                        ; Push it as an argument for current_esp.
+    call smp_timer_interrupt_handler ; Charges the time, schedules, and returns the NEW esp in EAX.
+    add  esp, 4                     ; Clean up the argument we pushed
+    mov  esp, eax                   ; Load the new task's stack pointer into ESP.
+    call task_switch_finish
+    popa
+    iret
+
+; This is the handler for the LAPIC timer (0x31) of the application processors.
+; Their IRQ0, as far as the scheduler is concerned.
+LAPIC_TIMER_HANDLER:
+    pusha
+    mov  eax, esp
+    push eax
+    call smp_timer_interrupt_handler ; Returns the NEW esp in EAX.
+    add  esp, 4
+    mov  esp, eax
+    call smp_lapic_eoi              ; ACK the LAPIC.
+    call task_switch_finish
+    popa
+    iret
+
+; This is the handler for the reschedule IPI (0x32). Another cpu queued a task for us,
+; or needs our timer restarted.
+RESCHED_HANDLER:
+    pusha
+    mov  eax, esp
+    push eax
+    call smp_resched_interrupt_handler ; Returns the NEW esp in EAX.
+    add  esp, 4
+    mov  esp, eax
+    call smp_lapic_eoi              ; ACK the LAPIC.
+    call task_switch_finish
+    popa
+    iret
+
+; This is the handler for the TLB shootdown IPI (0x33).
+TLB_HANDLER:
+    pusha
+    call smp_tlb_interrupt_handler
+    call smp_lapic_eoi              ; ACK the LAPIC.
+    popa
+    iret
+
+; The LAPIC's spurious interrupt (0xFF). It must not be ACKed.
+SPURIOUS_HANDLER:
+    iret
+
 ; This is the handler for IRQ 1 (keyboard)
 IRQ1_HANDLER:
     pusha                               ; Save all general-purpose registers
@@ -95,10 +162,49 @@ IRQ4_HANDLER:
 ; This is the handler for IRQ 14 (primary ata)
 IRQ14_HANDLER:
     pusha                               ; Save all general-purpose registers
+    push dword 14                       ; ide_interrupt_handler(irq)
     call ide_interrupt_handler
+    add  esp, 4
     mov  al, 0x20                        ; ACK PIC2 for the interrupt to stop firing.
     out  0xa0, al
     mov  al, 0x20                        ; ACK PIC1 either way.
     out  0x20, al
     popa                                ; Restore all registers
+    iret                                ; Return from interrupt
+
+; This is the handler for IRQ 15 (secondary ata)
+; PIC2 reports a spurious interrupt as IRQ 15 too. Those aren't in service, and only PIC1,
+; which did see the cascade, may be acknowledged for them.
+IRQ15_HANDLER:
+    pusha                               ; Save all general-purpose registers
+    mov  al, 0x0b                       ; OCW3: the next read of PIC2 is its in-service register.
+    out  0xa0, al
+    in   al, 0xa0
+    test al, 0x80
+    jz   .SPURIOUS
+    push dword 15                       ; ide_interrupt_handler(irq)
+    call ide_interrupt_handler
+    add  esp, 4
+    mov  al, 0x20                       ; ACK PIC2 for the interrupt to stop firing.
+    out  0xa0, al
+.SPURIOUS:
+    mov  al, 0x20                       ; ACK PIC1 either way.
+    out  0x20, al
+    popa                                ; Restore all registers
+    iret                                ; Return from interrupt
+
+; This is the handler for the PCI interrupt line of a native mode IDE controller.
+; ide_init() points the line's vector here and tells us which line it is in ide_native_irq.
+IDE_NATIVE_IRQ_HANDLER:
+    pusha                               ; Save all general-purpose registers
+    push dword [ide_native_irq]         ; ide_interrupt_handler(irq)
+    call ide_interrupt_handler
+    add  esp, 4
+    mov  al, 0x20
+    cmp  dword [ide_native_irq], 8      ; Lines 8-15 come through PIC2.
+    jb   .PIC1
+    out  0xa0, al                       ; ACK PIC2 for the interrupt to stop firing.
+.PIC1:
+    out  0x20, al                       ; ACK PIC1 either way.
+    popa                                ; Restore all registers
     iret                                ; Return from interrupt
\ No newline at end of file
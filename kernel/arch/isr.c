@@ -48,11 +48,34 @@ struct registers
 /* ... */
 void fault_handler(struct registers* regs)
 {
+    // Page faults in a task's program window are filled in on demand.
+    if(regs->int_no == 14 && paging_handle_fault(regs->err_code) == 0)
+    {
+        return;
+    }
+
+    // The first FPU/SSE instruction after a task switch loads the task's registers.
+    if(regs->int_no == 7 && fpu_handle_trap() == 0)
+    {
+        return;
+    }
+
     vga_disable_cursor();
     vga_printc('\n');
     vga_printd(regs->int_no);
     vga_prints(": ");
     vga_prints(exception_messages[regs->int_no]);
+    if(regs->int_no == 14)
+    {
+        uint32_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        vga_prints(" at ");
+        vga_printh(cr2);
+        vga_prints(" error ");
+        vga_printh(regs->err_code);
+        vga_prints(" eip ");
+        vga_printh(regs->eip);
+    }
     vga_printc('\n');
     SYSTEM_HALT();
 }
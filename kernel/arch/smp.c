@@ -0,0 +1,478 @@
+#include <kernel.h>
+#include <pit.h>
+#include <io.h>
+#include <string.h>
+
+/*
+ * Bringing up the other processors, and the local APIC each of them has.
+ *
+ * The boot cpu finds the processors in the ACPI MADT and starts each one with INIT and
+ * two STARTUP IPIs. They begin in real mode at the trampoline (trampoline.asm), which
+ * gets them into protected mode with our GDT, page directory and CR4, on the stack of
+ * their idle task, and calls smp_ap_main().
+ *
+ * Device interrupts stay with the 8259s, and so with the boot cpu. It also keeps the PIT,
+ * the clock and the sleep queue. The other cpus run their time slices off their LAPIC
+ * timers, one-shot like the PIT and counted in PIT counts, so the scheduler can't tell
+ * the difference. The cpus talk to each other through IPIs: a reschedule when one of them
+ * queued a task for another, and TLB shootdowns when a kernel mapping changed.
+ */
+
+// Local APIC registers, as offsets into its 4KiB page.
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0   // Spurious vector register. Bit 8 enables the LAPIC.
+#define LAPIC_ICR_LOW       0x300   // Interrupt command. Writing the low half sends the IPI.
+#define LAPIC_ICR_HIGH      0x310   // Destination APIC id in bits 24-31
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE        0x100
+#define LAPIC_LVT_MASKED        0x10000
+#define LAPIC_LVT_EXTINT        0x700   // Pass the 8259's interrupts through, like no APIC at all
+#define LAPIC_LVT_NMI           0x400
+#define LAPIC_ICR_PENDING       0x1000  // Delivery status. The last IPI hasn't been sent yet.
+#define LAPIC_ICR_INIT          0x4500  // INIT, level assert
+#define LAPIC_ICR_STARTUP       0x4600  // STARTUP. The vector is the start page.
+#define LAPIC_TIMER_DIVIDE_16   0x3
+
+// CPUID.01h:EDX feature bit.
+#define CPUID_FEATURE_APIC  (1 << 9)
+
+// The LAPIC counts down at the bus clock over 16. It is timed against the PIT over 10ms.
+#define SMP_CALIBRATE_US    10000
+#define SMP_SCALE_SHIFT     16
+
+// The trampoline is copied to this page. SIPI vector 0x08 = start at 0x8000.
+#define TRAMPOLINE_BASE     0x8000
+
+// How long to wait for a new cpu to check in. 100ms in 100us steps.
+#define SMP_AP_TIMEOUT      1000
+
+cpu_t smp_cpus[SMP_MAX_CPUS];
+volatile uint32_t smp_cpu_count = 1;
+
+// The cpu index of each APIC id. Everything is the boot cpu until we know better.
+static uint8_t smp_apic_to_cpu[256];
+
+// The LAPIC registers. NULL until smp_init() mapped them, and we are the only cpu.
+static volatile uint32_t* smp_lapic;
+
+// LAPIC counts = (PIT counts * lapic_mult) >> 16, and the other way around.
+static uint32_t smp_lapic_mult;
+static uint32_t smp_pit_mult;
+
+// What the trampoline needs to get a new cpu going. Read by trampoline.asm.
+uint32_t smp_ap_cr0;
+uint32_t smp_ap_cr4;
+uint32_t smp_ap_stack;
+
+// The IDT register of the boot cpu. Every cpu shares the one IDT.
+static struct {
+    uint16_t limit;
+    uint32_t base;
+}__attribute__((packed)) smp_idtr;
+
+// A TLB shootdown in flight. The cpus still to invalidate it have their bit set.
+static spinlock_t smp_tlb_lock;
+static volatile uint32_t smp_tlb_addr;
+static volatile uint32_t smp_tlb_pending;
+
+// From trampoline.asm.
+extern uint8_t SMP_TRAMPOLINE_START[];
+extern uint8_t SMP_TRAMPOLINE_GDTR[];
+extern uint8_t SMP_TRAMPOLINE_END[];
+
+extern uint32_t schedule(uint32_t);
+
+//========================================================================================
+/* Helper: Reads a LAPIC register. */
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return(smp_lapic[reg / 4]);
+}
+
+//========================================================================================
+/* Helper: Writes a LAPIC register. */
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    smp_lapic[reg / 4] = value;
+}
+
+//========================================================================================
+/* Helper: Returns (num << shift) / den with 32-bit math only. */
+static uint32_t smp_scale(uint32_t num, uint32_t den, uint32_t shift)
+{
+    uint32_t quotient = num / den;
+    uint32_t remainder = num % den;
+
+    // Long division, one bit at a time.
+    for(uint32_t i=0; i<shift; i++)
+    {
+        quotient <<= 1;
+        remainder <<= 1;
+        if(remainder >= den)
+        {
+            remainder -= den;
+            quotient |= 1;
+        }
+    }
+    return(quotient);
+}
+
+//========================================================================================
+/* Returns the index of the cpu we are running on. Call with interrupts disabled, or it may change under you. */
+uint32_t smp_cpu_index()
+{
+    if(!smp_lapic) { return(0); }
+    return(smp_apic_to_cpu[lapic_read(LAPIC_ID) >> 24]);
+}
+
+//========================================================================================
+/* Returns the scheduler state of the cpu we are running on. Same rules as smp_cpu_index(). */
+cpu_t* smp_cpu()
+{
+    return(&smp_cpus[smp_cpu_index()]);
+}
+
+//========================================================================================
+/* Helper: Sends an IPI to one cpu. Waits until the LAPIC took the previous one. */
+static void smp_send_ipi(uint8_t apic_id, uint32_t command)
+{
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+
+    while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    {
+        asm volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+
+    if(ints_enabled) { asm volatile("sti"); }
+}
+
+//========================================================================================
+/* Helper: Turns on the LAPIC of this cpu, with every local interrupt masked but the ones we want. */
+static void smp_lapic_enable(uint8_t boot_cpu)
+{
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SMP_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    // The 8259s are wired to LINT0 of the boot cpu, and it has the PIT for a timer.
+    // The others get their timer interrupt instead.
+    if(boot_cpu)
+    {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | SMP_TIMER_VECTOR);
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+    }
+    else
+    {
+        lapic_write(LAPIC_LVT_TIMER, SMP_TIMER_VECTOR);
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    }
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_EOI, 0);
+}
+
+//========================================================================================
+/* Helper: Times the LAPIC timer against the PIT. Returns 0 if it doesn't seem to run. */
+static uint32_t smp_lapic_calibrate()
+{
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    udelay(SMP_CALIBRATE_US);
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    if(ints_enabled) { asm volatile("sti"); }
+
+    if(counted < PIT_COUNTS_PER_TICK) { return(0); }
+    smp_lapic_mult = smp_scale(counted, PIT_COUNTS_PER_TICK, SMP_SCALE_SHIFT);
+    smp_pit_mult = smp_scale(PIT_COUNTS_PER_TICK, counted, SMP_SCALE_SHIFT);
+    return(counted);
+}
+
+//========================================================================================
+/*
+ * Helper: Starts a one-shot countdown of 'counts' PIT counts on this cpu's LAPIC timer.
+ * Like the PIT it never stops for longer than PIT_MAX_COUNT, so the scheduler's time
+ * accounting on this cpu is never more than that behind.
+ */
+static void smp_lapic_start(cpu_t* cpu, uint32_t counts)
+{
+    if(counts > PIT_MAX_COUNT) { counts = PIT_MAX_COUNT; }
+    if(counts < PIT_MIN_COUNT) { counts = PIT_MIN_COUNT; }
+
+    cpu->lapic_programmed = (uint32_t)(((uint64_t)counts * smp_lapic_mult) >> SMP_SCALE_SHIFT);
+    lapic_write(LAPIC_TIMER_INITIAL, cpu->lapic_programmed);
+}
+
+//========================================================================================
+/* Helper: Returns the PIT counts since this cpu's LAPIC timer was last started. */
+static uint32_t smp_lapic_elapsed(cpu_t* cpu)
+{
+    uint32_t current = lapic_read(LAPIC_TIMER_CURRENT);
+    uint32_t counted = (current < cpu->lapic_programmed) ? cpu->lapic_programmed - current : 0;
+    return((uint32_t)(((uint64_t)counted * smp_pit_mult) >> SMP_SCALE_SHIFT));
+}
+
+//========================================================================================
+/*
+ * Timer interrupt of every cpu, and the yield interrupt. The boot cpu has the PIT, the
+ * others their LAPIC timers. Returns the stack pointer of the task to run next.
+ */
+uint32_t smp_timer_interrupt_handler(uint32_t current_esp)
+{
+    cpu_t* cpu = smp_cpu();
+    if(cpu->index == 0)
+    {
+        return(timer_interrupt_handler(current_esp));
+    }
+
+    uint32_t flags = sched_lock();
+
+    task_tick(smp_lapic_elapsed(cpu));
+    uint32_t next_esp = schedule(current_esp);
+    smp_lapic_start(cpu, task_next_event());
+
+    sched_unlock(flags);
+    return(next_esp);
+}
+
+//========================================================================================
+/* Another cpu queued a task for us, or needs our timer. Same as a timer interrupt. */
+uint32_t smp_resched_interrupt_handler(uint32_t current_esp)
+{
+    smp_cpu()->ipis++;
+    return(smp_timer_interrupt_handler(current_esp));
+}
+
+//========================================================================================
+/* Another cpu changed a kernel mapping. Drop our copy of it. */
+void smp_tlb_interrupt_handler()
+{
+    uint32_t bit = 1 << smp_cpu_index();
+    if(smp_tlb_pending & bit)
+    {
+        paging_invalidate_page(smp_tlb_addr);
+        __sync_fetch_and_and(&smp_tlb_pending, ~bit);
+    }
+}
+
+//========================================================================================
+/* Acknowledges a LAPIC interrupt. Called by the interrupt handlers. */
+void smp_lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+//========================================================================================
+/*
+ * Brings this cpu's LAPIC timer up to date and restarts it for the next event.
+ * timer_sync() for the cpus other than the boot cpu.
+ */
+void smp_timer_sync()
+{
+    uint32_t flags = sched_lock();
+
+    cpu_t* cpu = smp_cpu();
+    task_tick(smp_lapic_elapsed(cpu));
+    smp_lapic_start(cpu, task_next_event());
+
+    sched_unlock(flags);
+}
+
+//========================================================================================
+/* Makes another cpu run its scheduler. */
+void smp_send_resched(uint32_t index)
+{
+    if(!smp_lapic || index >= SMP_MAX_CPUS || !smp_cpus[index].online) { return; }
+    smp_send_ipi(smp_cpus[index].apic_id, SMP_RESCHED_VECTOR);
+}
+
+//========================================================================================
+/*
+ * Makes every other cpu drop its translation of virt, and waits until they did.
+ * Our own was invalidated by the caller. Call with interrupts on, and no spinlock held.
+ */
+void smp_tlb_shootdown(uint32_t virt)
+{
+    if(smp_cpu_count < 2) { return; }
+
+    uint32_t flags = spin_lock_irqsave(&smp_tlb_lock);
+
+    // We may have moved since the caller invalidated it.
+    paging_invalidate_page(virt);
+
+    uint32_t self = smp_cpu_index();
+    uint32_t targets = 0;
+    for(uint32_t i=0; i<smp_cpu_count; i++)
+    {
+        if(i != self && smp_cpus[i].online) { targets |= 1 << i; }
+    }
+    smp_tlb_addr = virt;
+    smp_tlb_pending = targets;
+
+    for(uint32_t i=0; i<smp_cpu_count; i++)
+    {
+        if(targets & (1 << i)) { smp_send_ipi(smp_cpus[i].apic_id, SMP_TLB_VECTOR); }
+    }
+    while(smp_tlb_pending)
+    {
+        asm volatile("pause");
+    }
+
+    spin_unlock_irqrestore(&smp_tlb_lock, flags);
+}
+
+//========================================================================================
+/* Where the trampoline leaves an application processor, on the stack of its idle task. */
+void smp_ap_main()
+{
+    asm volatile("lidt %0" :: "m"(smp_idtr));
+
+    smp_lapic_enable(0);
+    fpu_init_ap();
+
+    // We are the idle task from here on. The scheduler switches away when there is work.
+    cpu_t* cpu = smp_cpu();
+    uint32_t flags = sched_lock();
+    cpu->current = cpu->idle;
+    cpu->idle->on_cpu = 1;
+    smp_cpu_count = cpu->index + 1;
+    cpu->online = 1;
+    sched_unlock(flags);
+
+    // Something may already be queued for us.
+    smp_timer_sync();
+
+    while(1)
+    {
+        asm volatile("sti; hlt");
+    }
+}
+
+//========================================================================================
+/* Helper: Starts one application processor. Returns 0 once it checked in, -1 if it never did. */
+static int smp_start_ap(uint8_t apic_id)
+{
+    uint32_t index = smp_cpu_count;
+    cpu_t* cpu = &smp_cpus[index];
+
+    struct task* idle = task_create_idle(index);
+    if(!idle) { return(-1); }
+
+    memset(cpu, 0, sizeof(cpu_t));
+    cpu->index = index;
+    cpu->apic_id = apic_id;
+    cpu->active = &cpu->run_queues[0];
+    cpu->expired = &cpu->run_queues[1];
+    cpu->idle = idle;
+    cpu->current = idle;
+    smp_apic_to_cpu[apic_id] = index;
+    smp_ap_stack = idle->stack_base + STACK_SIZE;
+
+    // INIT, then STARTUP twice, as the MP spec says.
+    smp_send_ipi(apic_id, LAPIC_ICR_INIT);
+    udelay(10000);
+    for(int i=0; i<2; i++)
+    {
+        smp_send_ipi(apic_id, LAPIC_ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+        udelay(200);
+    }
+
+    for(int i=0; i<SMP_AP_TIMEOUT && !cpu->online; i++)
+    {
+        udelay(100);
+    }
+    return(cpu->online ? 0 : -1);
+}
+
+//========================================================================================
+/*
+ * Starts every processor the MADT lists. Runs after tasking_init(), so each one can be
+ * given an idle task. Without ACPI or a LAPIC we just stay on the boot cpu.
+ */
+void smp_init()
+{
+    memset(smp_apic_to_cpu, 0, sizeof(smp_apic_to_cpu));
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if(!(edx & CPUID_FEATURE_APIC) || acpi_init() != 0)
+    {
+        return;
+    }
+
+    // The LAPIC registers are at the same address on every cpu. Never cache them.
+    uint32_t lapic_addr = acpi_madt.lapic_addr;
+    if(lapic_addr >= paging_identity_end \
+    && paging_map_page(lapic_addr, lapic_addr, PTE_READ_WRITE | PTE_CACHE_DISABLE | PTE_WRITE_THROUGH | paging_global_flag) != 0)
+    {
+        return;
+    }
+
+    // From here on smp_cpu_index() asks the LAPIC. The boot cpu is index 0 either way.
+    uint32_t flags = sched_lock();
+    smp_lapic = (volatile uint32_t*)lapic_addr;
+    uint8_t bsp_id = lapic_read(LAPIC_ID) >> 24;
+    smp_cpus[0].apic_id = bsp_id;
+    smp_cpus[0].index = 0;
+    smp_lapic_enable(1);
+    sched_unlock(flags);
+
+    if(!smp_lapic_calibrate() || acpi_madt.cpu_count < 2)
+    {
+        return;
+    }
+
+    // Everything the trampoline needs to look like us.
+    asm volatile("mov %%cr0, %0" : "=r"(smp_ap_cr0));
+    asm volatile("mov %%cr4, %0" : "=r"(smp_ap_cr4));
+    smp_ap_cr0 &= ~(1 << 3);  // CR0.TS. fpu_init_ap() sets it up.
+    asm volatile("sidt %0" : "=m"(smp_idtr));
+
+    uint32_t size = (uint32_t)(SMP_TRAMPOLINE_END - SMP_TRAMPOLINE_START);
+    memcpy(SMP_TRAMPOLINE_START, (void*)TRAMPOLINE_BASE, size);
+    asm volatile("sgdt %0" : "=m"(*(uint8_t*)(TRAMPOLINE_BASE + (SMP_TRAMPOLINE_GDTR - SMP_TRAMPOLINE_START))));
+
+    for(uint32_t i=0; i<acpi_madt.cpu_count && smp_cpu_count<SMP_MAX_CPUS; i++)
+    {
+        uint8_t apic_id = acpi_madt.apic_ids[i];
+        if(apic_id == bsp_id) { continue; }
+
+        // Whoever doesn't answer might still wake up later on the shared stack. Stop there.
+        if(smp_start_ap(apic_id) != 0)
+        {
+            kprintf("cpu with apic id %d did not start. ", apic_id);
+            break;
+        }
+    }
+}
+
+//========================================================================================
+/* Displays every cpu, what it runs, and how much work moved between them. */
+void smp_display_cpus()
+{
+    kprintf("cpu apic queued steals ipis   running\n");
+
+    uint32_t flags = sched_lock();
+    for(uint32_t i=0; i<smp_cpu_count; i++)
+    {
+        cpu_t* cpu = &smp_cpus[i];
+        if(!cpu->online) { continue; }
+        kprintf("%d   %d    %d      %d      %d      %s\n", cpu->index, cpu->apic_id, cpu->queued, cpu->steals, cpu->ipis, cpu->current ? cpu->current->name : "-");
+    }
+    sched_unlock(flags);
+
+    if(smp_lapic)
+    {
+        kprintf("lapic at %xh, %d ioapic(s), %d irq overrides\n", acpi_madt.lapic_addr, acpi_madt.ioapic_count, acpi_madt.overrides);
+    }
+}
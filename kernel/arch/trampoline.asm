@@ -0,0 +1,79 @@
+[bits 32]
+
+section .note.GNU-stack
+    ; This empty section's presence tells the linker
+    ; that the stack should be NON-EXECUTABLE.
+
+;=============================================================================================
+section .text
+
+global SMP_TRAMPOLINE_START
+global SMP_TRAMPOLINE_GDTR
+global SMP_TRAMPOLINE_END
+extern smp_ap_cr0
+extern smp_ap_cr4
+extern smp_ap_stack
+extern smp_ap_main
+extern page_dir_phys_addr
+
+; smp_init() copies everything from SMP_TRAMPOLINE_START to SMP_TRAMPOLINE_END here.
+; A STARTUP IPI with vector 0x08 starts an application processor at 0x0800:0000.
+TRAMPOLINE_BASE equ 0x8000
+
+;=============================================================================================
+;
+; An application processor wakes up in real mode, like the boot cpu did at power on.
+; Everything until the far jump runs from the copy at TRAMPOLINE_BASE, so memory
+; references have to be made relative to it. smp_init() fills in the GDTR below.
+[bits 16]
+SMP_TRAMPOLINE_START:
+    cli
+    cld
+    xor  ax, ax
+    mov  ds, ax
+
+    ; The kernel's own GDT. Its CODE_SEG (0x08) and DATA_SEG (0x10) are flat.
+    o32 lgdt [TRAMPOLINE_BASE + (SMP_TRAMPOLINE_GDTR - SMP_TRAMPOLINE_START)]
+
+    mov  eax, cr0
+    or   eax, 0x1           ; PE
+    mov  cr0, eax
+
+    ; Straight into the kernel. It is linked where it is loaded.
+    jmp  dword 0x08:AP_PROTECTED_MODE
+
+align 4
+SMP_TRAMPOLINE_GDTR:
+    dw 0                    ; Limit
+    dd 0                    ; Base
+SMP_TRAMPOLINE_END:
+
+;=============================================================================================
+[bits 32]
+AP_PROTECTED_MODE:
+    mov  ax, 0x10
+    mov  ds, ax
+    mov  es, ax
+    mov  fs, ax
+    mov  gs, ax
+    mov  ss, ax
+
+    ; Same paging features, same page directory, same CR0 as the boot cpu.
+    mov  eax, [smp_ap_cr4]
+    mov  cr4, eax
+    mov  eax, [page_dir_phys_addr]
+    mov  cr3, eax
+    mov  eax, [smp_ap_cr0]
+    mov  cr0, eax
+    jmp  .PAGING
+.PAGING:
+    ; We start out on the stack of our idle task.
+    mov  esp, [smp_ap_stack]
+    mov  ebp, esp
+    call smp_ap_main
+
+    ; smp_ap_main() never returns.
+    cli
+.LOOP:
+    hlt
+    jmp  .LOOP
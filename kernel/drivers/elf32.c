@@ -2,8 +2,12 @@
 #include <elf32.h>
 #include <string.h>
 
-/* ... */
-uint32_t elf32_parse_and_relocate(uint8_t* base)
+/*
+ * Loads every PT_LOAD segment of the elf image at base into the program window of space.
+ * Returns the entry address, 0xffffffff if it is not an elf file,
+ * 0xfffffffe if a segment is outside the program window, or 0xfffffffd if we ran out of memory.
+ */
+uint32_t elf32_parse_and_relocate(uint8_t* base, address_space_t* space)
 {
     if(base[0] == 0x7f \
     && base[1] == 'E' \
@@ -27,25 +31,45 @@ uint32_t elf32_parse_and_relocate(uint8_t* base)
             if(phdr.p_type == 1)
             {
                 // Not a valid exec location.
-                if(phdr.p_paddr < 0x300000 || phdr.p_paddr > 0x3fffff)
+                // Written so that no sum can wrap past the top of the address space.
+                if(phdr.p_vaddr < USER_IMAGE_BASE || phdr.p_vaddr >= USER_IMAGE_END ||
+                   phdr.p_memsz > USER_IMAGE_END - phdr.p_vaddr || phdr.p_filesz > phdr.p_memsz)
                 {
                     return(0xfffffffe);
                 }
 
-                // dst = physical_addr , src = offset_in_hdr.
-                uint8_t* dst = (uint8_t *)phdr.p_paddr;
+                // Back the pages that hold file data with zeroed frames in the task's address space.
+                // The rest of bss (memsz != filesz) is left unmapped and zero filled on first touch.
+                uint32_t first_page = phdr.p_vaddr & ~(PAGE_SIZE - 1);
+                for(uint32_t page=first_page; page<phdr.p_vaddr + phdr.p_filesz; page+=PAGE_SIZE)
+                {
+                    if(!paging_alloc_user_page(space, page, PTE_READ_WRITE))
+                    {
+                        return(0xfffffffd);
+                    }
+                }
+
+                // Copy the file data in through the identity map, one page at a time.
+                // dst = virtual_addr in the task, src = offset_in_hdr.
                 uint8_t* src = (uint8_t *)base + phdr.p_offset;
+                uint32_t dst = phdr.p_vaddr;
+                uint32_t left = phdr.p_filesz;
+                while(left > 0)
+                {
+                    uint32_t chunk = PAGE_SIZE - (dst & (PAGE_SIZE - 1));
+                    if(chunk > left) { chunk = left; }
 
-                // Copy the data to the physical_addr elf is expecting.
-                memcpy(src, dst, phdr.p_filesz);
+                    uint32_t physical = paging_get_user_physical(space, dst);
+                    if(!physical)
+                    {
+                        return(0xfffffffe);
+                    }
 
-                // If memsz != filesz , then we will probably need to zero out bss.
-                if(phdr.p_memsz != phdr.p_filesz)
-                {
-                    dst += phdr.p_filesz;
-                    size_t bss_size = phdr.p_memsz - phdr.p_filesz;
-                    memset(dst, 0, bss_size);
-                }               
+                    memcpy(src, (void*)physical, chunk);
+                    src  += chunk;
+                    dst  += chunk;
+                    left -= chunk;
+                }
             }
 
             // Skip to the next ELF_PHDR.
@@ -61,4 +85,4 @@ uint32_t elf32_parse_and_relocate(uint8_t* base)
     else {
         return(0xffffffff);
     }
-}
\ No newline at end of file
+}
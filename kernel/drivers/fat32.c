@@ -8,12 +8,17 @@ static struct fat32_bpb bpb;
 static uint32_t fat_start_lba;      // LBA = HiddenSec + ReservedSec
 static uint32_t data_start_lba;     // LBA = FAT_Start + (NumFATs * FATSz32)
 
+// Sector and cluster sized buffers are used over and over, so they come from caches.
+static slab_cache_t* sector_cache;
+static slab_cache_t* cluster_cache;
+
 //========================================================================================
 /* Initializes the BPB structure. */
 void fat32_init()
 {
     // Allocate a buffer to read the whole sector.
-    uint8_t* data = (uint8_t*)malloc(512);
+    sector_cache = slab_cache_create("fat32_sector", 512, 4);
+    uint8_t* data = (uint8_t*)slab_alloc(sector_cache);
     memset(data, 0, 512); 
 
     // Read the sector into the allocated buffer.
@@ -31,8 +36,11 @@ void fat32_init()
     fat_start_lba = bpb.hidden_sectors + bpb.reserved_sectors;
     data_start_lba = fat_start_lba + (bpb.fats_count * bpb.table_size_32);
 
+    // Now that we know the cluster size, set up the cache for directory buffers.
+    cluster_cache = slab_cache_create("fat32_cluster", bpb.sectors_per_cluster * 512, 2);
+
     // Free the allocated buffer.
-    free(data);
+    slab_free(sector_cache, data);
 }
 
 //========================================================================================
@@ -54,16 +62,22 @@ uint32_t get_next_cluster(uint32_t current_cluster)
     uint32_t ent_offset = fat_offset % 512;
     
     // Read that single FAT sector
-    uint32_t table_buffer[512];
+    uint32_t* table_buffer = (uint32_t*)slab_alloc(sector_cache);
+    if(!table_buffer)
+    {
+        return(0);
+    }
     
     // Assuming Drive 0 for now (Primary Master)
     if(ide_read_sectors(0, fat_sector, 1, table_buffer) != 0)
     {
+        slab_free(sector_cache, table_buffer);
         return(0);
     }
 
     // Read the entry and mask out the top 4 bits. And return it.
     uint32_t next_cluster = table_buffer[ent_offset/4] & 0x0FFFFFFF;
+    slab_free(sector_cache, table_buffer);
     return(next_cluster);
 }
 
@@ -106,7 +120,7 @@ void fat32_ls()
     uint32_t cluster_size = bpb.sectors_per_cluster * 512;
     
     // Allocate a buffer to hold one entire cluster of directory entries
-    uint8_t* buffer = (uint8_t*)malloc(cluster_size);
+    uint8_t* buffer = (uint8_t*)slab_alloc(cluster_cache);
 
     char formatted_name[13]; // 8 + 1 + 3 + null
     memset(formatted_name, 0, 13);
@@ -132,7 +146,7 @@ void fat32_ls()
             // 0x00 = No more entries in this directory
             if(dir[i].name[0] == 0x00) 
             {
-                free(buffer);
+                slab_free(cluster_cache, buffer);
                 return; 
             }
 
@@ -173,7 +187,7 @@ void fat32_ls()
         }
     }
 
-    free(buffer);
+    slab_free(cluster_cache, buffer);
 }
 
 //========================================================================================
@@ -184,7 +198,7 @@ file_t* fat32_read(const char* fname)
     struct fat32_directory_entry file_entry;
     uint32_t dir_cluster = bpb.root_cluster;
     uint32_t cluster_size_bytes = bpb.sectors_per_cluster * 512;
-    uint8_t* dir_buffer = (uint8_t*)malloc(cluster_size_bytes);
+    uint8_t* dir_buffer = (uint8_t*)slab_alloc(cluster_cache);
     static char formatted_name[13]; // 8 + 1 + 3 + null
     memset(formatted_name, 0, 13);
 
@@ -195,7 +209,7 @@ file_t* fat32_read(const char* fname)
         if(ide_read_sectors(0, lba, bpb.sectors_per_cluster, dir_buffer) != 0) 
         {
             kprintf("Read error in directory.\n");
-            free(dir_buffer);
+            slab_free(cluster_cache, dir_buffer);
             return((void* )0);
         }
 
@@ -225,7 +239,7 @@ file_t* fat32_read(const char* fname)
         dir_cluster = get_next_cluster(dir_cluster);
     }
     
-    free(dir_buffer);
+    slab_free(cluster_cache, dir_buffer);
     if(!found || found == -1) 
     {
         //kprintf("File not found: %s\n", fname);
@@ -250,13 +264,23 @@ file_t* fat32_read(const char* fname)
     while(bytes_left > 0 && current_file_cluster < 0x0FFFFFF8)
     {
         uint32_t lba = cluster_to_lba(current_file_cluster);
+
+        // Clusters that follow each other on disk are read with a single request.
+        uint32_t run_bytes = cluster_size_bytes;
+        uint32_t next_cluster = get_next_cluster(current_file_cluster);
+        while(run_bytes < bytes_left && next_cluster == current_file_cluster + 1)
+        {
+            current_file_cluster = next_cluster;
+            next_cluster = get_next_cluster(current_file_cluster);
+            run_bytes += cluster_size_bytes;
+        }
         
-        // Calculate how many bytes we want from THIS cluster.
-        // It is either the full cluster OR the remainder of the file.
-        uint32_t chunk_size = (bytes_left < cluster_size_bytes) ? bytes_left : cluster_size_bytes;
+        // Calculate how many bytes we want from THIS run of clusters.
+        // It is either the whole run OR the remainder of the file.
+        uint32_t chunk_size = (bytes_left < run_bytes) ? bytes_left : run_bytes;
 
         // Calculate how many sectors that chunk needs. (chunk_size + 511) / 512
-        uint8_t sectors_to_read = (chunk_size + 511) / 512;
+        uint32_t sectors_to_read = (chunk_size + 511) / 512;
         if(ide_read_sectors(0, lba, sectors_to_read, data_ptr) != 0) 
         {
             kprintf("Error reading file data.\n");
@@ -268,8 +292,8 @@ file_t* fat32_read(const char* fname)
         data_ptr += chunk_size; 
         bytes_left -= chunk_size;
 
-        // Get next cluster in the chain
-        current_file_cluster = get_next_cluster(current_file_cluster);
+        // Next cluster in the chain
+        current_file_cluster = next_cluster;
 
         // Root cluster should start at 2. And get_next_cluster() returns 0 if drive read error.
         if(current_file_cluster == 0)
@@ -5,124 +5,222 @@
 #include <io.h>
 #include <string.h>
 
-// For now just hard coding these assuming legacy.
-static uint16_t ide_data_port     = 0x1F0; // Primary Bus
-static uint16_t ide_control_port  = 0x3F6; // Primary Bus
+// Where each channel is when the controller runs it in compatibility (legacy) mode.
+#define IDE_PRIMARY_DATA        0x1F0
+#define IDE_PRIMARY_CONTROL     0x3F6
+#define IDE_PRIMARY_IRQ         14
+#define IDE_SECONDARY_DATA      0x170
+#define IDE_SECONDARY_CONTROL   0x376
+#define IDE_SECONDARY_IRQ       15
 
-// Structure used for the identify blob.
-// Since our ide driver is hard-coded to the Primary IDE channel's ports (0x1F0, 0x3F6), 
-// we only need to worry about 128 (Master) and 129 (Slave).
-struct ata_identify ata_ident[2];
+// prog_if has two bits per channel: native mode, and whether that can be switched.
+// Bit 7 says there is a bus master.
+#define IDE_PROGIF_NATIVE(c)        (0x01 << ((c) * 2))
+#define IDE_PROGIF_PROGRAMMABLE(c)  (0x02 << ((c) * 2))
+#define IDE_PROGIF_BUS_MASTER       0x80
+
+// In native mode BAR0/BAR1 are the primary channel, BAR2/BAR3 the secondary.
+// The control register is 2 into its BAR. Each channel's bus master registers take 8 ports of BAR4.
+#define IDE_NATIVE_CONTROL_OFFSET   2
+#define IDE_BM_CHANNEL_STRIDE       8
+
+// Two channels with a master and a slave each. Drive n is on channel n / 2:
+// 0 = primary master, 1 = primary slave, 2 = secondary master, 3 = secondary slave.
+#define IDE_CHANNELS    2
+#define IDE_DRIVES      4
+
+// Structure used for the identify blob, one per drive.
+struct ata_identify ata_ident[IDE_DRIVES];
 
 // These will be used for handling situations where we try to read from a drive that is not present.
-static uint8_t drives[2];
+static uint8_t drives[IDE_DRIVES];
+
+// 1 = the drive and the controller can both do DMA.
+static uint8_t drives_dma[IDE_DRIVES];
+
+// 1 = the drive takes LBA48 commands, and how many sectors it has.
+static uint8_t drives_lba48[IDE_DRIVES];
+static uint32_t drives_sectors[IDE_DRIVES];
+
+// Sectors per DRQ block after SET MULTIPLE MODE, 1 = no READ/WRITE MULTIPLE.
+// 1 = the data port can be read 32 bits at a time.
+static uint8_t drives_multiple[IDE_DRIVES];
+static uint8_t drives_dword[IDE_DRIVES];
+
+// Bigger blocks mean fewer interrupts, but each one is moved with interrupts off.
+#define IDE_MAX_MULTIPLE        16
+
+// How the data port is read and written.
+#define IDE_PIO_WORD_LOOP       0   // One INW/OUTW call per word
+#define IDE_PIO_STRING          1   // rep insw/outsw
+#define IDE_PIO_STRING32        2   // rep insd/outsd
+
+// What a transfer may use. All on, but ide_benchmark() turns them off to compare.
+static struct {
+    uint8_t dma;
+    uint8_t multiple;
+    uint8_t string;
+} ide_allow = { 1, 1, 1 };
+
+// The most sectors one command can move. A count of 0 means 256, or 65536 with LBA48.
+#define IDE_LBA28_MAX_SECTORS   256
+#define IDE_LBA48_MAX_SECTORS   65536
+#define IDE_LBA28_LIMIT         0x10000000
+
+// How long we wait on the drive before giving up.
+#define IDE_TIMEOUT_MS  500
+
+// A Physical Region Descriptor. The bus master walks a table of these until EOT.
+// A region can't cross a 64KiB boundary, and a count of 0 means 64KiB.
+struct ide_prd {
+    uint32_t base;              // Physical address, word aligned
+    uint16_t count;             // Bytes
+    uint16_t flags;             // IDE_PRD_EOT on the last one
+}__attribute__((packed));
+
+#define IDE_PRD_EOT     0x8000
+#define IDE_PRD_MAX     512
+
+// Caller buffers aren't physically contiguous, so each page gets a region. A DMA command
+// moves at most 1MiB, which touches at most 257 pages. Each table is one page, so it
+// never crosses 64KiB.
+#define IDE_DMA_MAX_SECTORS     2048
+static struct ide_prd ide_prdt[IDE_CHANNELS][IDE_PRD_MAX] __attribute__((aligned(PAGE_SIZE)));
+
+// Each channel takes one command at a time, but the two channels don't wait on each other.
+struct ide_channel {
+    uint16_t data_port;
+    uint16_t control_port;
+    uint16_t bmide_port;        // 0 = no DMA
+    uint8_t  irq;               // 14, 15, or whatever the PCI interrupt line says in native mode
+    uint8_t  present;           // 1 = a drive answered on it
+
+    // The command in flight. ide_interrupt_handler() moves its data, one block of
+    // sectors per interrupt, and wakes the task that issued it once the last one is done.
+    // A DMA request is moved by the bus master and only interrupts once, at the end.
+    // Guarded by lock, since the handler runs on the boot cpu and the task may not.
+    struct {
+        uint8_t  active;            // 1 = the interrupt handler owns the buffer
+        uint8_t  write;             // 1 = sectors go to the drive
+        uint8_t  dma;               // 1 = the bus master moves the data
+        uint8_t  method;            // IDE_PIO_*
+        uint32_t block;             // Sectors per interrupt
+        uint16_t* buffer;           // The next sector to move
+        volatile uint32_t sectors_left;
+        volatile uint8_t done;      // Set when the handler finished with the request
+        volatile int8_t  result;    // 0, or -1 on an error
+    } request;
+    spinlock_t lock;
+    wait_queue_t irq_queue;
+
+    // Whoever holds this owns the channel, with interrupts on for the whole transfer.
+    mutex_t mutex;
+
+    struct ide_prd* prdt;
+    uint32_t irqs;
+};
+static struct ide_channel ide_channels[IDE_CHANNELS];
+
+// The PCI interrupt line IDE_NATIVE_IRQ_HANDLER serves, for native channels that aren't on 14/15.
+uint32_t ide_native_irq;
+
+// Where the PICs put IRQ 0, and the lines that already have someone else's handler.
+#define IDE_IRQ_VECTOR_BASE     32
+#define IDE_IRQ_TAKEN           ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 4))
+
+// Sectors moved each way, for ide_display_info().
+static uint32_t ide_dma_sectors;
+static uint32_t ide_pio_sectors;
+
+// ide_benchmark() reads this many sectors each way.
+#define IDE_BENCH_SECTORS       2048
 
 //========================================================================================
 /* Waits ~400ns by reading the alternate status port 4 times. */
-static void ide_delay_400ns()
+static void ide_delay_400ns(struct ide_channel* ch)
 {
-    INB(ide_control_port + ATA_REG_ALT_STATUS);
-    INB(ide_control_port + ATA_REG_ALT_STATUS);
-    INB(ide_control_port + ATA_REG_ALT_STATUS);
-    INB(ide_control_port + ATA_REG_ALT_STATUS);
+    INB(ch->control_port + ATA_REG_ALT_STATUS);
+    INB(ch->control_port + ATA_REG_ALT_STATUS);
+    INB(ch->control_port + ATA_REG_ALT_STATUS);
+    INB(ch->control_port + ATA_REG_ALT_STATUS);
 }
 
 //========================================================================================
-/* Initialize IDE drives. */
-void ide_init()
-{  
-    pci_probe_devices();
-    int controller_found = 0;
-
-    // Iterate all devices in the header structure until we find a controller..
-    for(int i=0; i<256; i++)
-    {
-        // Check if the controller is for legacy IDE.
-        if(pci_device_hdr[i].class_code == 1 && pci_device_hdr[i].subclass == 1)
-        {
-            // We are just worrying about legacy ports 0x1F0 and 0x3F6.
-            if(pci_device_hdr[i].prog_if == 0x8a 
-            || pci_device_hdr[i].prog_if == 0x80)
-            {
-                controller_found = 1;
-                break;
-            }
-        }
-    }
-
-    // ...
-    if(!controller_found) 
+/*
+ * Helper: Waits for BSY to clear, like after IDENTIFY. Returns the last status, or
+ * 0xFF if the drive never came back.
+ */
+static uint8_t ide_wait_for_not_busy(struct ide_channel* ch)
+{
+    uint32_t start_ms = clock_get_ms();
+    uint8_t status;
+    while((status = INB(ch->data_port + ATA_REG_STATUS)) & ATA_SR_BSY)
     {
-        kprintf("No capable legacy IDE controller found.\n");
-        SYSTEM_HALT();
+        if((clock_get_ms() - start_ms) > IDE_TIMEOUT_MS) { return(0xFF); }
     }
+    return(status);
+}
 
-    drives[0] = 0;
-    drives[1] = 0; 
+//========================================================================================
+/* Helper: Looks for a master and a slave on a channel, and sets up what they support. */
+static void ide_probe_channel(struct ide_channel* ch, uint8_t channel)
+{
+    // Make sure the drives interrupt us. (nIEN = 0)
+    OUTB(ch->control_port + ATA_REG_DEV_CTRL, 0x00);
 
     // Look for any master or slave.
-    for(int i=0; i<2; i++)
+    for(int unit=0; unit<2; unit++)
     {
-        uint8_t drive_select;
-        if(i == 0) 
-        {
-            drive_select = ATA_SELECT_MASTER;
-        }
-        else if(i == 1)
-        { 
-            drive_select = ATA_SELECT_SLAVE;
-        }
+        uint8_t i = (channel * 2) + unit;
+        uint8_t drive_select = (unit == 0) ? ATA_SELECT_MASTER : ATA_SELECT_SLAVE;
 
         // Select the drive.
-        OUTB(ide_data_port + ATA_REG_DRIVE, drive_select);
-        ide_delay_400ns();
+        OUTB(ch->data_port + ATA_REG_DRIVE, drive_select);
+        ide_delay_400ns(ch);
         
         // Reset sector counts and LBA registers (set to 0)
-        OUTB(ide_data_port + ATA_REG_SECCOUNT, 0);
-        OUTB(ide_data_port + ATA_REG_LBA_LOW,  0);
-        OUTB(ide_data_port + ATA_REG_LBA_MID,  0);
-        OUTB(ide_data_port + ATA_REG_LBA_HIGH, 0);
+        OUTB(ch->data_port + ATA_REG_SECCOUNT, 0);
+        OUTB(ch->data_port + ATA_REG_LBA_LOW,  0);
+        OUTB(ch->data_port + ATA_REG_LBA_MID,  0);
+        OUTB(ch->data_port + ATA_REG_LBA_HIGH, 0);
         
         // Send the IDENTIFY command
-        OUTB(ide_data_port + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
-        ide_delay_400ns();
+        OUTB(ch->data_port + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+        ide_delay_400ns(ch);
         
         // Check the status port
-        uint8_t status = INB(ide_data_port + ATA_REG_STATUS);
+        uint8_t status = INB(ch->data_port + ATA_REG_STATUS);
 
-        // Does the drive exist?
-        if(status == 0) 
+        // Does the drive exist? A channel with nothing on it floats to 0xFF.
+        if(status == 0 || status == 0xFF) 
         {
             continue;   // Does not.
         }
 
         // Wait for BSY to clear
-        uint32_t start_ticks = timer_get_ticks();
-        uint32_t timeout = 50; // 50 ticks = approx 500ms
-        while(INB(ide_data_port + ATA_REG_STATUS) & ATA_SR_BSY) 
+        if(ide_wait_for_not_busy(ch) == 0xFF)
         {
-            // Check for Timeout
-            if((timer_get_ticks() - start_ticks) > timeout)
-            {
-                kprintf("Error timed out waiting for ready!\n");
-                SYSTEM_HALT();
-            }
-            continue; 
+            kprintf("Error timed out waiting for ready!\n");
+            continue;
         }
 
         // Check for LBA_MID or LBA_HIGH non-zero, which means it's not ATA
-        if(INB(ide_data_port + ATA_REG_LBA_MID)  != 0 \
-        || INB(ide_data_port + ATA_REG_LBA_HIGH) != 0)
+        if(INB(ch->data_port + ATA_REG_LBA_MID)  != 0 \
+        || INB(ch->data_port + ATA_REG_LBA_HIGH) != 0)
         {
             continue;
         }
 
         // Wait for DRQ or ERR
-        while(!((status = INB(ide_data_port + ATA_REG_STATUS)) & ATA_SR_DRQ) \
-           && !((status & ATA_SR_ERR))) { continue; }
+        uint32_t start_ms = clock_get_ms();
+        while(!((status = INB(ch->data_port + ATA_REG_STATUS)) & ATA_SR_DRQ) \
+           && !((status & ATA_SR_ERR)))
+        {
+            if((clock_get_ms() - start_ms) > IDE_TIMEOUT_MS) { break; }
+        }
 
         // Did we have an error identifying the drive?
-        if(status & ATA_SR_ERR)
+        if((status & ATA_SR_ERR) || !(status & ATA_SR_DRQ))
         {
             continue;
         }
@@ -131,31 +229,205 @@ void ide_init()
         uint16_t identify_buffer[256];
         memset(identify_buffer, 0, sizeof(identify_buffer));
 
-        // Loop through the 512 byte block in 16bit increments.
-        for(int i = 0; i<256; i++) 
-        {
-            identify_buffer[i] = INW(ide_data_port + ATA_REG_DATA);
-        }
+        // The whole 512 byte block in 16bit increments.
+        INSW(ch->data_port + ATA_REG_DATA, identify_buffer, 256);
 
         // Let's use the buffer we just captured to fill in our ident structure.
         memset(&ata_ident[i], 0, sizeof(struct ata_identify));
         memcpy(identify_buffer, &ata_ident[i], sizeof(struct ata_identify));
 
         drives[i] = 1;
+        ch->present = 1;
+
+        // Past 2^32 sectors (2TiB) our LBAs can't reach anyway.
+        drives_sectors[i] = ata_ident[i].total_sectors_28bit;
+        if(ata_ident[i].command_sets_supported & ATA_CMDSET_LBA48)
+        {
+            drives_lba48[i] = 1;
+            uint64_t total = ata_ident[i].total_sectors_48bit;
+            drives_sectors[i] = (total >> 32) ? 0xFFFFFFFF : (uint32_t)total;
+        }
+
+        // Word 48 was dropped after ATA-1. Later drives set bit 14 there, and bit 0 means something else.
+        if((ata_ident[i].doubleword & 0xC000) != 0x4000 && (ata_ident[i].doubleword & 0x0001))
+        {
+            drives_dword[i] = 1;
+        }
+
+        // Let the drive hand us several sectors per interrupt.
+        uint8_t block = ata_ident[i].max_multiple & 0xFF;
+        if(block > IDE_MAX_MULTIPLE) { block = IDE_MAX_MULTIPLE; }
+        if(block > 1)
+        {
+            OUTB(ch->data_port + ATA_REG_SECCOUNT, block);
+            OUTB(ch->data_port + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+            ide_delay_400ns(ch);
+
+            status = ide_wait_for_not_busy(ch);
+            if(!(status & (ATA_SR_BSY | ATA_SR_ERR | ATA_SR_DF)))
+            {
+                drives_multiple[i] = block;
+            }
+        }
+
+        // Any multiword or Ultra DMA mode will do. The firmware already picked the timing.
+        if(ch->bmide_port && (ata_ident[i].capabilities & ATA_CAP_DMA) \
+        && ((ata_ident[i].multiword_dma & 0x07) || (ata_ident[i].ultra_dma & 0x7F)))
+        {
+            drives_dma[i] = 1;
+        }
+    }
+
+    // Tell the controller which drives we DMA with.
+    if(ch->bmide_port)
+    {
+        uint8_t bm_status = INB(ch->bmide_port + BM_REG_STATUS) & ~(BM_SR_DRV0_DMA | BM_SR_DRV1_DMA);
+        if(drives_dma[channel * 2])     { bm_status |= BM_SR_DRV0_DMA; }
+        if(drives_dma[channel * 2 + 1]) { bm_status |= BM_SR_DRV1_DMA; }
+        OUTB(ch->bmide_port + BM_REG_STATUS, bm_status | BM_SR_ERR | BM_SR_IRQ);
+    }
+}
+
+//========================================================================================
+/* Helper: Unmasks a line on the PIC it comes through. Lines 8-15 also need the cascade, which is always open. */
+static void ide_unmask_irq(uint8_t irq)
+{
+    if(irq < 8) { OUTB(0x21, INB(0x21) & ~(1 << irq)); }
+    else        { OUTB(0xA1, INB(0xA1) & ~(1 << (irq - 8))); }
+}
+
+//========================================================================================
+/* Initialize IDE drives, on both channels of the first IDE controller. */
+void ide_init()
+{  
+    pci_probe_devices();
+    struct _pci_device_hdr* controller = NULL;
+
+    // Iterate all devices in the header structure until we find a controller..
+    for(int i=0; i<256; i++)
+    {
+        if(pci_device_hdr[i].class_code == 1 && pci_device_hdr[i].subclass == 1)
+        {
+            controller = &pci_device_hdr[i];
+            break;
+        }
+    }
+
+    // ...
+    if(!controller) 
+    {
+        kprintf("No IDE controller found.\n");
+        SYSTEM_HALT();
+    }
+
+    memset(drives, 0, sizeof(drives));
+    memset(drives_dma, 0, sizeof(drives_dma));
+    memset(drives_lba48, 0, sizeof(drives_lba48));
+    memset(drives_sectors, 0, sizeof(drives_sectors));
+    memset(drives_multiple, 1, sizeof(drives_multiple));
+    memset(drives_dword, 0, sizeof(drives_dword));
+    ide_dma_sectors = 0;
+    ide_pio_sectors = 0;
+
+    // A channel in native mode we can switch back to compatibility mode gets switched, so
+    // it ends up on the interrupt we have a handler for.
+    uint8_t prog_if = controller->prog_if;
+    for(int c=0; c<IDE_CHANNELS; c++)
+    {
+        if((prog_if & IDE_PROGIF_NATIVE(c)) && (prog_if & IDE_PROGIF_PROGRAMMABLE(c)))
+        {
+            prog_if &= ~IDE_PROGIF_NATIVE(c);
+        }
+    }
+    if(prog_if != controller->prog_if)
+    {
+        uint32_t reg8 = pci_conf_read_dword(controller->bus, controller->slot, controller->func, 0x08);
+        reg8 = (reg8 & 0xFFFF00FF) | ((uint32_t)prog_if << 8);
+        pci_conf_write_dword(controller->bus, controller->slot, controller->func, 0x08, reg8);
+        prog_if = (pci_conf_read_dword(controller->bus, controller->slot, controller->func, 0x08) >> 8) & 0xff;
+        controller->prog_if = prog_if;
+    }
+
+    // The bus master, if there is one, does DMA for both channels.
+    uint16_t bmide_base = 0;
+    if((prog_if & IDE_PROGIF_BUS_MASTER) && controller->bar4 && controller->bar4 < 0x10000)
+    {
+        bmide_base = (uint16_t)controller->bar4;
+        pci_enable_bus_master(controller);
+    }
+
+    uint32_t bars[4] = { controller->bar0, controller->bar1, controller->bar2, controller->bar3 };
+    for(int c=0; c<IDE_CHANNELS; c++)
+    {
+        struct ide_channel* ch = &ide_channels[c];
+        memset(ch, 0, sizeof(struct ide_channel));
+        ch->prdt = ide_prdt[c];
+
+        if(prog_if & IDE_PROGIF_NATIVE(c))
+        {
+            // Native mode. The ports are wherever the BARs say, and the interrupt is the PCI one.
+            ch->data_port    = bars[c * 2 + 1] ? (uint16_t)bars[c * 2] : 0;
+            ch->control_port = (uint16_t)(bars[c * 2 + 1] + IDE_NATIVE_CONTROL_OFFSET);
+            ch->irq          = controller->int_line;
+        }
+        else
+        {
+            ch->data_port    = (c == 0) ? IDE_PRIMARY_DATA    : IDE_SECONDARY_DATA;
+            ch->control_port = (c == 0) ? IDE_PRIMARY_CONTROL : IDE_SECONDARY_CONTROL;
+            ch->irq          = (c == 0) ? IDE_PRIMARY_IRQ     : IDE_SECONDARY_IRQ;
+        }
+
+        if(!ch->data_port)
+        {
+            kprintf("ide: %s channel has no ports in its BARs, ignored.\n", (c == 0) ? "primary" : "secondary");
+            continue;
+        }
+
+        // IRQ 14 and 15 have their own handlers. Any other line of a native channel gets
+        // IDE_NATIVE_IRQ_HANDLER, unless it is missing (0xFF) or already somebody else's.
+        if(ch->irq != IDE_PRIMARY_IRQ && ch->irq != IDE_SECONDARY_IRQ)
+        {
+            if(ch->irq >= 16 || (IDE_IRQ_TAKEN & (1 << ch->irq)))
+            {
+                kprintf("ide: %s channel is on irq %d, which we can't take, ignored.\n", \
+                    (c == 0) ? "primary" : "secondary", ch->irq);
+                ch->data_port = 0;
+                continue;
+            }
+            ide_native_irq = ch->irq;
+            IDT_SET_GATE(IDE_NATIVE_IRQ_HANDLER, IDE_IRQ_VECTOR_BASE + ch->irq);
+        }
+
+        if(bmide_base)
+        {
+            ch->bmide_port = bmide_base + (c * IDE_BM_CHANNEL_STRIDE);
+            OUTB(ch->bmide_port + BM_REG_COMMAND, 0);
+        }
+
+        wait_queue_init(&ch->irq_queue);
+        mutex_init(&ch->mutex, (c == 0) ? "ide_primary" : "ide_secondary");
+
+        ide_probe_channel(ch, c);
+
+        // IRQ 14 is always unmasked. Any other line only once there is something on it.
+        if(ch->present && ch->irq != IDE_PRIMARY_IRQ)
+        {
+            ide_unmask_irq(ch->irq);
+        }
     }
 }
 
 //========================================================================================
 /* Helper function to wait for the drive to be ready */
-static int ide_wait_for_ready()
+static int ide_wait_for_ready(struct ide_channel* ch)
 {
-    uint32_t start_ticks = timer_get_ticks();
-    uint32_t timeout = 50; // 50 ticks = approx 500ms
+    uint32_t start_ms = clock_get_ms();
+    uint32_t timeout = IDE_TIMEOUT_MS;
 
     uint8_t status = 0;
     while(1) 
     {
-        status = INB(ide_data_port + ATA_REG_STATUS);
+        status = INB(ch->data_port + ATA_REG_STATUS);
         if (status & ATA_SR_ERR) { /*kprintf("\nIDE ERROR\n");*/ return(-1); }
         if (status & ATA_SR_DF)  { /*kprintf("\nIDE DRIVE FAULT\n");*/ return(-1); }
         // If BSY bit is clear and DRDY is set, it's ready
@@ -164,7 +436,7 @@ static int ide_wait_for_ready()
         }
 
         // Check for Timeout
-        if((timer_get_ticks() - start_ticks) > timeout)
+        if((clock_get_ms() - start_ms) > timeout)
         {
             kprintf("Error timed out waiting for ready!\n");
             return(-1);
@@ -174,188 +446,608 @@ static int ide_wait_for_ready()
 }
 
 //========================================================================================
-/* Reads num_sectors from lba into buffer. This uses Polling PIO. */
-int ide_read_sectors(uint8_t drive, uint32_t lba, uint8_t num_sectors, void* buffer)
+/* Helper function to wait for the drive to request data (DRQ) */
+static int ide_wait_for_drq(struct ide_channel* ch)
 {
-    if(drives[drive] == 0) { return(-1); }
+    uint32_t start_ms = clock_get_ms();
+    uint32_t timeout = IDE_TIMEOUT_MS;
 
-    // I will need to revisit this lock when I switch to interrupts on IDE.
-    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
-    asm volatile("cli");    // Disable interrupts to be safe.
+    uint8_t status = 0;
+    while(1) 
+    {
+        status = INB(ch->data_port + ATA_REG_STATUS);
+        if(status & ATA_SR_ERR) { /*kprintf("\nIDE Error waiting for DRQ!\n");*/ return(-1); }
+        if(status & ATA_SR_DF)  { /*kprintf("\nIDE Drive Fault waiting for DRQ!\n");*/ return(-1); }
+        if(status & ATA_SR_DRQ) { break; } // Data is ready!
 
-    // This variable will hold 0b11100000 (Master) or 0b11110000 (Slave)
-    uint8_t drive_cmd;
-    if(drive == 0) // Master
+        // Check for Timeout
+        if((clock_get_ms() - start_ms) > timeout)
+        {
+            kprintf("Error timed out waiting for ready!\n");
+            return(-1);
+        }
+    }
+    return 0;
+}
+
+//========================================================================================
+/* Helper: Reads sectors from the data port, one DRQ block's worth. */
+static void ide_pio_read_block(struct ide_channel* ch, uint16_t* buffer, uint32_t sectors, uint8_t method)
+{
+    if(method == IDE_PIO_STRING32)
+    {
+        INSL(ch->data_port + ATA_REG_DATA, buffer, sectors * 128);
+    }
+    else if(method == IDE_PIO_STRING)
     {
-        drive_cmd = 0xE0;   
-    } 
+        INSW(ch->data_port + ATA_REG_DATA, buffer, sectors * 256);
+    }
+    else
+    {
+        for(uint32_t i = 0; i<sectors * 256; i++)
+        {
+            buffer[i] = INW(ch->data_port + ATA_REG_DATA);
+        }
+    }
+}
 
-    if(drive == 1) // Slave
+//========================================================================================
+/* Helper: Writes sectors to the data port, one DRQ block's worth. */
+static void ide_pio_write_block(struct ide_channel* ch, uint16_t* buffer, uint32_t sectors, uint8_t method)
+{
+    if(method == IDE_PIO_STRING32)
+    {
+        OUTSL(ch->data_port + ATA_REG_DATA, buffer, sectors * 128);
+    }
+    else if(method == IDE_PIO_STRING)
     {
-        drive_cmd = 0xF0;
+        OUTSW(ch->data_port + ATA_REG_DATA, buffer, sectors * 256);
     }
+    else
+    {
+        for(uint32_t i = 0; i<sectors * 256; i++)
+        {
+            OUTW(ch->data_port + ATA_REG_DATA, buffer[i]);
+        }
+    }
+}
 
-    // Select drive (Master or Slave) and set LBA mode
-    OUTB(ide_data_port + ATA_REG_DRIVE, drive_cmd | ((lba >> 24) & 0x0F));
-    ide_delay_400ns();
+//========================================================================================
+/* Helper: Hands a request to the interrupt handler. Call before the command is sent. */
+static void ide_start_request(struct ide_channel* ch, uint8_t write, uint8_t dma, uint8_t method, uint32_t block, uint16_t* buffer, uint32_t sectors)
+{
+    uint32_t flags = spin_lock_irqsave(&ch->lock);
+    ch->request.write = write;
+    ch->request.dma = dma;
+    ch->request.method = method;
+    ch->request.block = block;
+    ch->request.buffer = buffer;
+    ch->request.sectors_left = sectors;
+    ch->request.done = 0;
+    ch->request.result = 0;
+    ch->request.active = 1;
+    spin_unlock_irqrestore(&ch->lock, flags);
+}
+
+//========================================================================================
+/*
+ * Helper: Sleeps until the interrupt handler finished the request. Returns 0 or -1.
+ * We only give up once the drive made no progress for IDE_TIMEOUT_MS.
+ */
+static int ide_wait_for_request(struct ide_channel* ch)
+{
+    uint32_t start_ms = clock_get_ms();
+    uint32_t last_left = ch->request.sectors_left;
+
+    while(1)
+    {
+        uint32_t now = clock_get_ms();
+        if(ch->request.sectors_left != last_left)
+        {
+            last_left = ch->request.sectors_left;
+            start_ms = now;
+        }
+        uint32_t waited = now - start_ms;
+
+        // The check and going to sleep happen under the scheduler lock, so the wake up can't slip in between.
+        uint32_t flags = sched_lock();
+        if(ch->request.done)
+        {
+            sched_unlock(flags);
+            break;
+        }
+        if(waited >= IDE_TIMEOUT_MS)
+        {
+            sched_unlock(flags);
+
+            // Take the buffer back, so a late interrupt can't touch it.
+            flags = spin_lock_irqsave(&ch->lock);
+            uint8_t done = ch->request.done;
+            ch->request.active = 0;
+            if(!done && ch->request.dma)
+            {
+                OUTB(ch->bmide_port + BM_REG_COMMAND, 0);
+            }
+            spin_unlock_irqrestore(&ch->lock, flags);
+            if(done) { break; }
+
+            kprintf("Error timed out waiting for the drive!\n");
+            return(-1);
+        }
+        wait_queue_wait(&ch->irq_queue, IDE_TIMEOUT_MS - waited);
+        sched_unlock(flags);
+    }
+    return(ch->request.result);
+}
+
+//========================================================================================
+/* Helper: Returns 1 if a command needs LBA48, because of where it goes or how big it is. */
+static uint8_t ide_needs_lba48(uint32_t lba, uint32_t num_sectors)
+{
+    return(num_sectors > IDE_LBA28_MAX_SECTORS || lba + num_sectors > IDE_LBA28_LIMIT);
+}
+
+//========================================================================================
+/*
+ * Helper: Selects the drive and loads the sector count and the LBA28 or LBA48 address.
+ * Returns 0 once the command can be sent, or -1.
+ */
+static int ide_setup_command(struct ide_channel* ch, uint8_t drive, uint32_t lba, uint32_t num_sectors, uint8_t lba48)
+{
+    // This variable will hold 0b11100000 (Master) or 0b11110000 (Slave)
+    uint8_t drive_cmd = ((drive & 1) == 0) ? 0xE0 : 0xF0;
+
+    // Select drive (Master or Slave) and set LBA mode. LBA48 keeps no address bits here.
+    OUTB(ch->data_port + ATA_REG_DRIVE, lba48 ? drive_cmd : (drive_cmd | ((lba >> 24) & 0x0F)));
+    ide_delay_400ns(ch);
 
     // After selecting a drive (writing to 0x1F6), 
     // we must wait for that specific drive to report it is ready before sending the Sector Count and LBA registers.
-    if(ide_wait_for_ready() != 0) 
-    { 
-        if(ints_enabled) { asm volatile("sti"); }
-        return(-1); 
+    if(ide_wait_for_ready(ch) != 0) { return(-1); }
+
+    // LBA48 registers are two deep. The high bytes go in first: count 15:8, LBA 47:24.
+    if(lba48)
+    {
+        OUTB(ch->data_port + ATA_REG_SECCOUNT, (uint8_t)((num_sectors >> 8) & 0xFF));
+        OUTB(ch->data_port + ATA_REG_LBA_LOW,  (uint8_t)((lba >> 24) & 0xFF));
+        OUTB(ch->data_port + ATA_REG_LBA_MID,  0);
+        OUTB(ch->data_port + ATA_REG_LBA_HIGH, 0);
     }
-    
-    // Send sector count
-    OUTB(ide_data_port + ATA_REG_SECCOUNT, num_sectors);
-    
-    // Send LBA28 address (in 3 parts)
-    OUTB(ide_data_port + ATA_REG_LBA_LOW,  (uint8_t)((lba & 0xFF)));
-    OUTB(ide_data_port + ATA_REG_LBA_MID,  (uint8_t)((lba >> 8) & 0xFF));
-    OUTB(ide_data_port + ATA_REG_LBA_HIGH, (uint8_t)((lba >> 16) & 0xFF));
-    
-    // Send the READ (PIO) command
-    OUTB(ide_data_port + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
-
-    // Read the data, one sector at a time
-    uint16_t* read_buffer = (uint16_t*)buffer;
-    for(int s=0; s<num_sectors; s++)
+
+    // Send sector count. 256 (or 65536) wraps to 0, which is what the drive wants.
+    OUTB(ch->data_port + ATA_REG_SECCOUNT, (uint8_t)(num_sectors & 0xFF));
+
+    // Send the low 24 bits of the LBA (in 3 parts)
+    OUTB(ch->data_port + ATA_REG_LBA_LOW,  (uint8_t)(lba & 0xFF));
+    OUTB(ch->data_port + ATA_REG_LBA_MID,  (uint8_t)((lba >> 8) & 0xFF));
+    OUTB(ch->data_port + ATA_REG_LBA_HIGH, (uint8_t)((lba >> 16) & 0xFF));
+    return(0);
+}
+
+//========================================================================================
+/*
+ * Helper: Returns 1 if bytes at buffer touch the program window. It is mapped differently
+ * in each task and backed lazily, and the interrupt handler moving PIO data or the bus
+ * master could be looking at someone else's, or at nothing.
+ */
+static int ide_in_program_window(void* buffer, uint64_t bytes)
+{
+    uint64_t start = (uint32_t)buffer;
+    return(start < USER_IMAGE_END && start + bytes > USER_IMAGE_BASE);
+}
+
+//========================================================================================
+/*
+ * Helper: Describes bytes of buffer to the bus master, one physical run at a time.
+ * Returns 0, or -1 if the buffer can't be handed to it and we have to use PIO.
+ */
+static int ide_build_prdt(struct ide_channel* ch, void* buffer, uint32_t bytes)
+{
+    uint32_t virt = (uint32_t)buffer;
+
+    // Regions must be word aligned.
+    if((virt & 1) || ide_in_program_window(buffer, bytes)) { return(-1); }
+
+    uint32_t count = 0;
+    while(bytes)
     {
-        // Wait for the drive to be ready with the data
-        while(1) 
-        {
-            uint8_t status = INB(ide_data_port + ATA_REG_STATUS);
-            if (status & ATA_SR_ERR) 
-            { 
-                //kprintf("\nRead Error!");
-                if(ints_enabled) { asm volatile("sti"); } 
-                return(-1); 
-            }
-            if (status & ATA_SR_DRQ) { break; } // Data is ready!
-        }
+        uint32_t phys = paging_get_physical(virt);
+        if(!phys) { return(-1); }
 
-        // Read 256 16-bit words (512 bytes)
-        for(int i = 0; i<256; i++)
+        uint32_t chunk = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if(chunk > bytes) { chunk = bytes; }
+
+        // Grow the last region if this page follows it without crossing into the next 64KiB.
+        struct ide_prd* last = count ? &ch->prdt[count - 1] : NULL;
+        if(last && last->base + last->count == phys && (phys & 0xFFFF) \
+        && (last->base & 0xFFFF0000) == (phys & 0xFFFF0000))
+        {
+            last->count += chunk;
+        }
+        else
         {
-            read_buffer[i] = INW(ide_data_port + ATA_REG_DATA);
+            if(count == IDE_PRD_MAX) { return(-1); }
+            ch->prdt[count].base = phys;
+            ch->prdt[count].count = chunk;
+            ch->prdt[count].flags = 0;
+            count++;
         }
-        read_buffer += 256; // Move buffer pointer to next sector
+
+        virt += chunk;
+        bytes -= chunk;
     }
 
-    if(ints_enabled) { asm volatile("sti"); }
-    return(0);  // Success
+    ch->prdt[count - 1].flags = IDE_PRD_EOT;
+    return(0);
 }
 
 //========================================================================================
-/* Helper function to wait for the drive to request data (DRQ) */
-static int ide_wait_for_drq()
+/*
+ * Helper: Moves num_sectors with the bus master, through the PRD table that is set up
+ * already. The drive interrupts once when it is all done. Call with the channel held.
+ */
+static int ide_dma_transfer(struct ide_channel* ch, uint8_t drive, uint32_t lba, uint32_t num_sectors, uint8_t write)
 {
-    uint32_t start_ticks = timer_get_ticks();
-    uint32_t timeout = 50; // 50 ticks = approx 500ms
+    // Stop the engine, point it at the table, clear the last status and set the direction.
+    uint8_t direction = write ? 0 : BM_CMD_READ;
+    OUTB(ch->bmide_port + BM_REG_COMMAND, 0);
+    OUTL(ch->bmide_port + BM_REG_PRDT, paging_get_physical((uint32_t)ch->prdt));
+    OUTB(ch->bmide_port + BM_REG_STATUS, INB(ch->bmide_port + BM_REG_STATUS) | BM_SR_ERR | BM_SR_IRQ);
+    OUTB(ch->bmide_port + BM_REG_COMMAND, direction);
 
-    uint8_t status = 0;
-    while(1) 
+    uint8_t lba48 = ide_needs_lba48(lba, num_sectors);
+    if(ide_setup_command(ch, drive, lba, num_sectors, lba48) != 0) { return(-1); }
+
+    // Send the command, then let the bus master go.
+    uint8_t command = write ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA) \
+                            : (lba48 ? ATA_CMD_READ_DMA_EXT  : ATA_CMD_READ_DMA);
+    ide_start_request(ch, write, 1, 0, num_sectors, NULL, num_sectors);
+    OUTB(ch->data_port + ATA_REG_COMMAND, command);
+    OUTB(ch->bmide_port + BM_REG_COMMAND, direction | BM_CMD_START);
+
+    int ret = ide_wait_for_request(ch);
+    if(ret == 0) { __sync_fetch_and_add(&ide_dma_sectors, num_sectors); }
+    return(ret);
+}
+
+//========================================================================================
+/* Helper: Picks how the data port is moved for a drive. */
+static uint8_t ide_pio_method(uint8_t drive)
+{
+    if(!ide_allow.string) { return(IDE_PIO_WORD_LOOP); }
+    return(drives_dword[drive] ? IDE_PIO_STRING32 : IDE_PIO_STRING);
+}
+
+//========================================================================================
+/*
+ * Helper: Reads num_sectors with PIO. The interrupt handler moves each block of sectors
+ * as the drive gets it ready. Call with the channel held.
+ */
+static int ide_pio_read(struct ide_channel* ch, uint8_t drive, uint32_t lba, uint32_t num_sectors, void* buffer)
+{
+    uint8_t lba48 = ide_needs_lba48(lba, num_sectors);
+    if(ide_setup_command(ch, drive, lba, num_sectors, lba48) != 0) { return(-1); }
+
+    // READ MULTIPLE once SET MULTIPLE MODE took, READ SECTORS (one sector per block) otherwise.
+    uint32_t block = ide_allow.multiple ? drives_multiple[drive] : 1;
+    uint8_t command = (block > 1) ? (lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE) \
+                                  : (lba48 ? ATA_CMD_READ_PIO_EXT      : ATA_CMD_READ_PIO);
+
+    // Send the READ command. The drive interrupts us once each block is ready.
+    ide_start_request(ch, 0, 0, ide_pio_method(drive), block, (uint16_t*)buffer, num_sectors);
+    OUTB(ch->data_port + ATA_REG_COMMAND, command);
+
+    int ret = ide_wait_for_request(ch);
+    if(ret == 0) { __sync_fetch_and_add(&ide_pio_sectors, num_sectors); }
+    return(ret);
+}
+
+//========================================================================================
+/*
+ * Helper: Writes num_sectors with PIO. We send the first block, the interrupt handler
+ * the rest as the drive asks for them. Call with the channel held.
+ */
+static int ide_pio_write(struct ide_channel* ch, uint8_t drive, uint32_t lba, uint32_t num_sectors, void* buffer)
+{
+    uint8_t lba48 = ide_needs_lba48(lba, num_sectors);
+    if(ide_setup_command(ch, drive, lba, num_sectors, lba48) != 0) { return(-1); }
+
+    uint32_t block = ide_allow.multiple ? drives_multiple[drive] : 1;
+    uint8_t command = (block > 1) ? (lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE) \
+                                  : (lba48 ? ATA_CMD_WRITE_PIO_EXT      : ATA_CMD_WRITE_PIO);
+    uint8_t method = ide_pio_method(drive);
+
+    // Send the WRITE command. Everything after the first block is the handler's.
+    uint16_t* write_buffer = (uint16_t*)buffer;
+    uint32_t first = (num_sectors < block) ? num_sectors : block;
+    ide_start_request(ch, 1, 0, method, block, write_buffer + (first * 256), num_sectors - first);
+    OUTB(ch->data_port + ATA_REG_COMMAND, command);
+
+    // The first block is asked for right away, without an interrupt.
+    if(ide_wait_for_drq(ch) != 0)
     {
-        status = INB(ide_data_port + ATA_REG_STATUS);
-        if(status & ATA_SR_ERR) { /*kprintf("\nIDE Error waiting for DRQ!\n");*/ return(-1); }
-        if(status & ATA_SR_DF)  { /*kprintf("\nIDE Drive Fault waiting for DRQ!\n");*/ return(-1); }
-        if(status & ATA_SR_DRQ) { break; } // Data is ready!
+        uint32_t flags = spin_lock_irqsave(&ch->lock);
+        ch->request.active = 0;
+        spin_unlock_irqrestore(&ch->lock, flags);
+        return(-1);
+    }
+    ide_pio_write_block(ch, write_buffer, first, method);
 
-        // Check for Timeout
-        if((timer_get_ticks() - start_ticks) > timeout)
+    // The drive interrupts once per block it took. The last one means it is all on disk.
+    int ret = ide_wait_for_request(ch);
+    if(ret == 0 && ide_wait_for_ready(ch) != 0) { ret = -1; }
+    if(ret == 0) { __sync_fetch_and_add(&ide_pio_sectors, num_sectors); }
+    return(ret);
+}
+
+//========================================================================================
+/*
+ * Helper: Splits a request into as few commands as the drive takes, each with DMA when
+ * the drive and that part of the buffer allow it, PIO otherwise. The channel is taken
+ * per command, so a big request doesn't shut everyone else out for its whole length.
+ */
+static int ide_transfer(uint8_t drive, uint32_t lba, uint32_t num_sectors, void* buffer, uint8_t write)
+{
+    if(drive >= IDE_DRIVES || drives[drive] == 0) { return(-1); }
+    if(num_sectors == 0) { return(0); }
+    if(lba >= drives_sectors[drive] || num_sectors > drives_sectors[drive] - lba) { return(-1); }
+
+    // Neither DMA nor the interrupt handler can reach a task's program window. Callers copy through a kernel buffer.
+    if(ide_in_program_window(buffer, (uint64_t)num_sectors << 9)) { return(-1); }
+
+    struct ide_channel* ch = &ide_channels[drive / 2];
+    uint32_t max_sectors = drives_lba48[drive] ? IDE_LBA48_MAX_SECTORS : IDE_LBA28_MAX_SECTORS;
+    uint8_t* next = (uint8_t*)buffer;
+    while(num_sectors)
+    {
+        uint32_t count = (num_sectors < max_sectors) ? num_sectors : max_sectors;
+
+        // Other tasks keep running while we wait on the drive, but only one of them gets the channel.
+        // The other channel is free for anyone.
+        mutex_lock(&ch->mutex);
+
+        int ret;
+        uint32_t dma_count = (count < IDE_DMA_MAX_SECTORS) ? count : IDE_DMA_MAX_SECTORS;
+        if(drives_dma[drive] && ide_allow.dma && ide_build_prdt(ch, next, dma_count * 512) == 0)
         {
-            kprintf("Error timed out waiting for ready!\n");
-            return(-1);
+            count = dma_count;
+            ret = ide_dma_transfer(ch, drive, lba, count, write);
+        }
+        else if(write)
+        {
+            ret = ide_pio_write(ch, drive, lba, count, next);
         }
+        else
+        {
+            ret = ide_pio_read(ch, drive, lba, count, next);
+        }
+
+        mutex_unlock(&ch->mutex);
+        if(ret != 0) { return(ret); }
+
+        lba += count;
+        next += count * 512;
+        num_sectors -= count;
     }
-    return 0;
+    return(0);
 }
 
 //========================================================================================
-/* Writes num_sectors from lba from buffer. */
-int ide_write_sectors(uint8_t drive, uint32_t lba, uint8_t num_sectors, void* buffer)
+/*
+ * Reads num_sectors from lba into buffer. Any number of sectors, as long as they are on
+ * the drive. We sleep until the last one is in.
+ */
+int ide_read_sectors(uint8_t drive, uint32_t lba, uint32_t num_sectors, void* buffer)
 {
-    if(drives[drive] == 0) { return(-1); }
+    return(ide_transfer(drive, lba, num_sectors, buffer, 0));
+}
 
-    // I will need to revisit this lock when I switch to interrupts on IDE.
-    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
-    asm volatile("cli");    // Disable interrupts to be safe.
+//========================================================================================
+/*
+ * Writes num_sectors from lba from buffer. Any number of sectors, as long as they are on
+ * the drive. We sleep until the drive is done.
+ */
+int ide_write_sectors(uint8_t drive, uint32_t lba, uint32_t num_sectors, void* buffer)
+{
+    return(ide_transfer(drive, lba, num_sectors, buffer, 1));
+}
 
-    // This variable will hold 0b11100000 (Master) or 0b11110000 (Slave)
-    uint8_t drive_cmd;
-    if(drive == 0) // Master
+//========================================================================================
+/* Displays the drives we found, how they are driven, and how much went each way. */
+void ide_display_info()
+{
+    for(int c=0; c<IDE_CHANNELS; c++)
     {
-        drive_cmd = 0xE0;  
-    } 
+        struct ide_channel* ch = &ide_channels[c];
+        if(!ch->data_port) { continue; }
+        kprintf("%s: io %xh ctrl %xh irq %d, bus master %s, %d interrupts\n", (c == 0) ? "primary" : "secondary", \
+            ch->data_port, ch->control_port, ch->irq, ch->bmide_port ? "yes" : "no", ch->irqs);
 
-    if(drive == 1) // Slave
-    {
-        drive_cmd = 0xF0;
+        for(int i=c * 2; i<(c * 2) + 2; i++)
+        {
+            if(!drives[i]) { continue; }
+            kprintf("  ide%d: %s, %d sectors, %s, %s, %d sectors/block, %d-bit pio\n", i, (i & 1) ? "slave" : "master", \
+                drives_sectors[i], drives_lba48[i] ? "lba48" : "lba28", drives_dma[i] ? "dma" : "pio", \
+                drives_multiple[i], drives_dword[i] ? 32 : 16);
+        }
     }
+    kprintf("%d sectors dma, %d sectors pio\n", ide_dma_sectors, ide_pio_sectors);
+}
 
-    // Select drive (Master or Slave) and set LBA mode
-    OUTB(ide_data_port + ATA_REG_DRIVE, drive_cmd | ((lba >> 24) & 0x0F));
-    ide_delay_400ns();
+//========================================================================================
+/*
+ * Reads the start of ide0 with each way of moving data we have, slowest first, and
+ * shows how long it took and how many interrupts it needed.
+ */
+void ide_benchmark()
+{
+    static const struct {
+        const char* name;
+        uint8_t dma;
+        uint8_t multiple;
+        uint8_t string;
+    } modes[] = {
+        { "pio, INW loop, 1 sector/irq  ", 0, 0, 0 },
+        { "pio, rep ins,  1 sector/irq  ", 0, 0, 1 },
+        { "pio, rep ins,  multiple      ", 0, 1, 1 },
+        { "dma                          ", 1, 1, 1 },
+    };
 
-    // After selecting a drive (writing to 0x1F6), 
-    // we must wait for that specific drive to report it is ready before sending the Sector Count and LBA registers.
-    if(ide_wait_for_ready() != 0) { 
-        if(ints_enabled) { asm volatile("sti"); }
-        return(-1); 
+    if(!drives[0] || drives_sectors[0] < IDE_BENCH_SECTORS)
+    {
+        kprintf("No drive to read from.\n");
+        return;
     }
-    
-    // Send sector count
-    OUTB(ide_data_port + ATA_REG_SECCOUNT, num_sectors);
-    
-    // Send LBA28 address (in 3 parts)
-    OUTB(ide_data_port + ATA_REG_LBA_LOW,  (uint8_t)(lba & 0xFF));
-    OUTB(ide_data_port + ATA_REG_LBA_MID,  (uint8_t)((lba >> 8) & 0xFF));
-    OUTB(ide_data_port + ATA_REG_LBA_HIGH, (uint8_t)((lba >> 16) & 0xFF));
-    
-    // Send the WRITE (PIO) command
-    OUTB(ide_data_port + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
-
-    // Write the data, one sector at a time.
-    uint16_t* write_buffer = (uint16_t*)buffer;
-    for(int s = 0; s < num_sectors; s++)
+
+    void* buffer = malloc(IDE_BENCH_SECTORS * 512);
+    if(!buffer)
+    {
+        kprintf("Not enough memory for the benchmark.\n");
+        return;
+    }
+
+    kprintf("%d KiB from ide0 (%d sectors/block, %d-bit pio)\n", IDE_BENCH_SECTORS / 2, drives_multiple[0], drives_dword[0] ? 32 : 16);
+    kprintf("mode                            ms      KiB/s   irqs\n");
+    for(uint32_t i=0; i<sizeof(modes) / sizeof(modes[0]); i++)
     {
-        // Wait for the drive to be ready *for the data* (DRQ)
-        if(ide_wait_for_drq() != 0) { 
-            if(ints_enabled) { asm volatile("sti"); }
-            return(-1); 
+        if(modes[i].dma && !drives_dma[0])
+        {
+            kprintf("%s  (no dma)\n", modes[i].name);
+            continue;
         }
 
-        // Write 256 16-bit words (512 bytes)
-        for(int i = 0; i < 256; i++)
+        ide_allow.dma = modes[i].dma;
+        ide_allow.multiple = modes[i].multiple;
+        ide_allow.string = modes[i].string;
+
+        uint32_t irqs = ide_channels[0].irqs;
+        uint32_t start_ms = clock_get_ms();
+        int ret = ide_read_sectors(0, 0, IDE_BENCH_SECTORS, buffer);
+        uint32_t ms = clock_get_ms() - start_ms;
+        irqs = ide_channels[0].irqs - irqs;
+
+        if(ret != 0)
         {
-            OUTW(ide_data_port + ATA_REG_DATA, write_buffer[i]);
+            kprintf("%s  read failed\n", modes[i].name);
+            continue;
         }
-        write_buffer += 256; // Move buffer pointer to next sector
-    }
-    
-    // Wait for the write to complete
-    // After the last sector is sent, the drive will be busy
-    // writing. We must wait for it to be ready again.
-    if(ide_wait_for_ready() != 0) { 
-        if(ints_enabled) { asm volatile("sti"); }
-        return(-1); 
+        uint32_t kib_per_s = (IDE_BENCH_SECTORS / 2) * 1000 / (ms ? ms : 1);
+        kprintf("%s  %d      %d   %d\n", modes[i].name, ms, kib_per_s, irqs);
     }
 
-    if(ints_enabled) { asm volatile("sti"); }
-    return(0);  // Success
+    ide_allow.dma = 1;
+    ide_allow.multiple = 1;
+    ide_allow.string = 1;
+    free(buffer);
 }
 
 //========================================================================================
-// This is the function called by IRQ14_HANDLER
-void ide_interrupt_handler()
+/* Helper: Moves the next block of the channel's request, and wakes its task once it is complete. */
+static void ide_channel_interrupt(struct ide_channel* ch)
 {
-    // TODO: Work on switching to interrupt based as opposed to polling. I am having the most trouble.
-    //       Once I get tasking down to a tee, then I should come back here and work on interrupts.
-    //       Because I will need to stop a specific task as opposed to the whole cpu.
-    //kprintf("*");
-    
-    // For now, we just acknowledge the interrupt.
     // We must read the status register to clear the interrupt.
-    INB(ide_data_port + ATA_REG_STATUS);
-}
\ No newline at end of file
+    uint8_t status = INB(ch->data_port + ATA_REG_STATUS);
+
+    spin_lock(&ch->lock);
+    ch->irqs++;
+
+    // Nobody waits for an interrupt we didn't ask for, like the one after IDENTIFY.
+    uint8_t finished = 0;
+    if(ch->request.active)
+    {
+        if(ch->request.dma)
+        {
+            // The bus master saw the drive interrupt. Stop it and see how it went.
+            uint8_t bm_status = INB(ch->bmide_port + BM_REG_STATUS);
+            if(bm_status & BM_SR_IRQ)
+            {
+                OUTB(ch->bmide_port + BM_REG_COMMAND, 0);
+                OUTB(ch->bmide_port + BM_REG_STATUS, bm_status | BM_SR_ERR | BM_SR_IRQ);
+                if((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)))
+                {
+                    ch->request.result = -1;
+                }
+                ch->request.sectors_left = 0;
+                finished = 1;
+            }
+        }
+        else if(status & (ATA_SR_ERR | ATA_SR_DF))
+        {
+            ch->request.result = -1;
+            finished = 1;
+        }
+        else if(!ch->request.write)
+        {
+            // Each interrupt of a read means a block is waiting for us. The last one may be short.
+            if(status & ATA_SR_DRQ)
+            {
+                uint32_t sectors = ch->request.sectors_left;
+                if(sectors > ch->request.block) { sectors = ch->request.block; }
+                ide_pio_read_block(ch, ch->request.buffer, sectors, ch->request.method);
+                ch->request.buffer += sectors * 256;
+                ch->request.sectors_left -= sectors;
+                finished = (ch->request.sectors_left == 0);
+            }
+        }
+        else if(ch->request.sectors_left)
+        {
+            // The drive took a block and wants the next one.
+            if(status & ATA_SR_DRQ)
+            {
+                uint32_t sectors = ch->request.sectors_left;
+                if(sectors > ch->request.block) { sectors = ch->request.block; }
+                ide_pio_write_block(ch, ch->request.buffer, sectors, ch->request.method);
+                ch->request.buffer += sectors * 256;
+                ch->request.sectors_left -= sectors;
+            }
+            else
+            {
+                ch->request.result = -1;
+                finished = 1;
+            }
+        }
+        else
+        {
+            // The last sector is written.
+            finished = 1;
+        }
+
+        if(finished)
+        {
+            ch->request.active = 0;
+            ch->request.done = 1;
+        }
+    }
+
+    spin_unlock(&ch->lock);
+
+    // Wake the task waiting on the drive.
+    if(finished) { wait_queue_wake_all(&ch->irq_queue); }
+}
+
+//========================================================================================
+// This is the function called by IRQ14_HANDLER and IRQ15_HANDLER.
+// A native mode controller may have both channels on one interrupt. Then the bus
+// master's interrupt bit tells us which of them it was.
+void ide_interrupt_handler(uint32_t irq)
+{
+    uint8_t shared = (ide_channels[0].irq == ide_channels[1].irq);
+    for(int c=0; c<IDE_CHANNELS; c++)
+    {
+        struct ide_channel* ch = &ide_channels[c];
+        if(!ch->present || ch->irq != irq) { continue; }
+
+        if(shared && ch->bmide_port)
+        {
+            uint8_t bm_status = INB(ch->bmide_port + BM_REG_STATUS);
+            if(!(bm_status & BM_SR_IRQ)) { continue; }
+
+            // A DMA request needs the bit to see it finished. Everything else clears it here.
+            if(!ch->request.dma)
+            {
+                OUTB(ch->bmide_port + BM_REG_STATUS, bm_status | BM_SR_IRQ);
+            }
+        }
+        ide_channel_interrupt(ch);
+    }
+}
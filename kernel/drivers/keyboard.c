@@ -21,19 +21,27 @@ static char scancode_to_ascii_shifted[] = {
     '4', '5', '6', '+', '1', '2', '3', '0', '.',
 };
 
+// Woken whenever something lands in keyboard_input_buffer.
+wait_queue_t keyboard_wait_queue;
+
 static uint8_t shift_key_pressed; 
 //static uint8_t caps_key_pressed;
-uint8_t f12_pressed;    // Used to start the kernel shell.
+// Signaled with a KEYBOARD_HOTKEY_ bit when a hotkey is pressed.
+event_t keyboard_hotkeys;
 
 volatile char keyboard_input_buffer[1024];
 static size_t keyboard_buffer_index;
 
+// The buffer is filled on the boot cpu, but may be reset from any of them.
+static spinlock_t keyboard_lock;
+
 //========================================================================================
 /* Initialize the keyboard. */
 void keyboard_init()
 {
     shift_key_pressed = 0;
-    f12_pressed = 0;
+    event_init(&keyboard_hotkeys);
+    wait_queue_init(&keyboard_wait_queue);
     keyboard_reset_buffer();
     return;
 }
@@ -42,12 +50,12 @@ void keyboard_init()
 /* Feels like only keyboard should reset the keyboard buffer for next use. */
 void keyboard_reset_buffer()
 {
-    asm volatile("cli");
+    uint32_t flags = spin_lock_irqsave(&keyboard_lock);
     for(int i = 0; i < 1024; i++) {
         keyboard_input_buffer[i] = 0;
     }
     keyboard_buffer_index = 0;
-    asm volatile("sti");
+    spin_unlock_irqrestore(&keyboard_lock, flags);
 }
 
 //========================================================================================
@@ -64,10 +72,7 @@ void keyboard_interrupt_handler()
 
         if(scancode == 0x58) 
         {
-            if(!f12_pressed)
-            {
-                f12_pressed = 1;
-            }
+            event_signal(&keyboard_hotkeys, KEYBOARD_HOTKEY_F12);
             return;
         }
 
@@ -111,19 +116,30 @@ void keyboard_interrupt_handler()
         // Handle Backspace
         if (c == '\b')
         {
-            if (keyboard_buffer_index > 0)
+            spin_lock(&keyboard_lock);
+            uint8_t changed = (keyboard_buffer_index > 0);
+            if (changed)
             {
                 keyboard_input_buffer[keyboard_buffer_index] = c;   // Add '\b' to the buffer so callers can handle.
                 --keyboard_buffer_index;
             }
+            spin_unlock(&keyboard_lock);
+            if (changed) { wait_queue_wake_all(&keyboard_wait_queue); }
             return;
         }
 
         // Add the normal character to the buffer.
-        if(keyboard_buffer_index < 1023)
+        spin_lock(&keyboard_lock);
+        uint8_t added = (keyboard_buffer_index < 1023);
+        if(added)
         {
             keyboard_input_buffer[keyboard_buffer_index] = c;
             keyboard_buffer_index++;
+        }
+        spin_unlock(&keyboard_lock);
+        if(added)
+        {
+            wait_queue_wake_all(&keyboard_wait_queue);
             return;
         }
         
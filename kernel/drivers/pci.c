@@ -8,7 +8,8 @@ struct _pci_device_hdr pci_device_hdr[256];
 
 //========================================================================================
 /* ... */
-static uint32_t pci_conf_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) 
+/* Helper: Builds the address of a config register for the address port. */
+static uint32_t pci_conf_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
 {
     /* Create the 32-bit address.
     The critical part is building the 32-bit integer to send to the 0xCF8 address port. It's a bit-packed field.
@@ -27,14 +28,28 @@ static uint32_t pci_conf_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uin
     address |= ((uint32_t)slot << 11);  // Add the Slot number (left-shifted 11 bits)
     address |= ((uint32_t)func << 8);   // Add the Function number (left-shifted 8 bits)
     address |= (offset & 0xFC);         // (offset & 0xFC) clears the last two bits (0b11111100).
+    return(address);
+}
 
+//========================================================================================
+/* Reads a 32-bit config register. */
+uint32_t pci_conf_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) 
+{
     // Write the address to the Address Port (0xCF8).
-    OUTL(CONFIG_ADDRESS, address);
+    OUTL(CONFIG_ADDRESS, pci_conf_address(bus, slot, func, offset));
     
     // Read the 32-bit data from the Data Port (0xCFC).
     return INL(CONFIG_DATA);
 }
 
+//========================================================================================
+/* Writes a 32-bit config register. */
+void pci_conf_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value)
+{
+    OUTL(CONFIG_ADDRESS, pci_conf_address(bus, slot, func, offset));
+    OUTL(CONFIG_DATA, value);
+}
+
 //========================================================================================
 /* ... */
 void pci_probe_devices()
@@ -124,6 +139,10 @@ void pci_probe_devices()
                     pci_device_hdr[index].min_grant   = (reg3C >> 16) & 0xff;
                     pci_device_hdr[index].int_pin     = (reg3C >> 8) & 0xff;
                     pci_device_hdr[index].int_line    = (reg3C & 0xff);
+
+                    pci_device_hdr[index].bus  = bus;
+                    pci_device_hdr[index].slot = slot;
+                    pci_device_hdr[index].func = func;
                     
                     // ...
                     index++;
@@ -139,6 +158,19 @@ void pci_probe_devices()
     }
 }
 
+//========================================================================================
+/*
+ * Lets a device master the bus, so it can do DMA on its own. The status half of the
+ * register is write-1-to-clear, so it is written back as zeros.
+ */
+void pci_enable_bus_master(struct _pci_device_hdr* dev)
+{
+    uint32_t reg4 = pci_conf_read_dword(dev->bus, dev->slot, dev->func, 0x04);
+    uint16_t command = (reg4 & 0xffff) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER;
+    pci_conf_write_dword(dev->bus, dev->slot, dev->func, 0x04, command);
+    dev->command = command;
+}
+
 //========================================================================================
 /* Iterate the PCI devices and display information. */
 void pci_conf_display()
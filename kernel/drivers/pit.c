@@ -3,72 +3,207 @@
 
 extern uint32_t schedule(uint32_t);
 
+/*
+ * Only the boot cpu takes IRQ0, and its timer keeps the clock and the sleep queue.
+ * The other cpus have their LAPIC timers for their time slices. See smp.c.
+ * The clock below is guarded by the scheduler lock, the PIT itself by pit_lock.
+ */
+static spinlock_t pit_lock;
+
+// Elapsed time. Whole 10ms ticks, and the PIT counts into the current tick.
 static volatile uint32_t timer_ticks;
-static volatile size_t timer_counter;
+static volatile uint32_t timer_tick_counts;
+
+// The count the PIT was last started with. It interrupts once when that runs out.
+static volatile uint32_t timer_programmed;
+
+// PIT counts left for timer_wait().
+static volatile uint32_t timer_wait_counts;
 
 //========================================================================================
-/* Initialize the pit with 100hz and square wave continous interrupts. */
-void timer_init()
+/* Helper: Starts a one-shot countdown on channel 0. IRQ0 fires when it runs out. */
+static void timer_start(uint32_t counts)
 {
-    timer_ticks = 0;
-    timer_counter = 0;
+    if(counts > PIT_MAX_COUNT) { counts = PIT_MAX_COUNT; }
+    if(counts < PIT_MIN_COUNT) { counts = PIT_MIN_COUNT; }
 
-    // 1,193,180 (ticks/sec) / 100 (interrupts/sec) = 11931 (ticks/interrupt)
-    int divisor = 1193180 / 100;   // Calculate our divisor
+    uint32_t flags = spin_lock_irqsave(&pit_lock);
+    timer_programmed = counts;
 
-    // The value 0x36 is 00110110 in binary, and each set of bits is a command:
+    // The value 0x30 is 00110000 in binary, and each set of bits is a command:
     // 00: Select Channel 0. The PIT has three channels. Channel 0 is the one hardwired to IRQ 0, the system timer.
-    // 11: Set Access Mode to "Lobyte/Hibyte". This tells the PIT that you're about to send a 16-bit divisor in two 8-bit pieces: the Low Byte first, then the High Byte.
-    // 011: Set Operating Mode to "Mode 3 (Square Wave Generator)". This makes the PIT generate a continuous train of interrupts (a "square wave") at the frequency you set.
+    // 11: Set Access Mode to "Lobyte/Hibyte". The 16-bit count follows in two 8-bit pieces, low byte first.
+    // 000: Set Operating Mode to "Mode 0 (Interrupt On Terminal Count)". The output goes high once, when the count reaches 0.
     // 0: Use 16-bit Binary mode (not BCD, which is an older format).
-    OUTB(0x43, 0x36);               // Set our command byte 0x36
+    OUTB(0x43, 0x30);
+    OUTB(0x40, counts & 0xFF);
+    OUTB(0x40, counts >> 8);
+    spin_unlock_irqrestore(&pit_lock, flags);
+}
 
-    // 0x40: This is the data port for Channel 0.
-    OUTB(0x40, divisor & 0xFF);     // Set low byte of divisor
-    OUTB(0x40, divisor >> 8);       // Set high byte of divisor
+//========================================================================================
+/*
+ * Returns the PIT counts since the countdown was last started. Call with interrupts disabled.
+ * The counter keeps going down past 0 (wrapping to 0xFFFF), so this stays right for a
+ * while after the countdown ran out, even when IRQ0 could not be taken yet.
+ */
+uint32_t timer_elapsed()
+{
+    // Any cpu may ask. The latch and the three reads have to stay together.
+    uint32_t flags = spin_lock_irqsave(&pit_lock);
+
+    // Read-back command: latch the status and the count of channel 0.
+    OUTB(0x43, 0xC2);
+    uint8_t status = INB(0x40);
+    uint32_t count = INB(0x40);
+    count |= (uint32_t)INB(0x40) << 8;
+    uint32_t programmed = timer_programmed;
+
+    spin_unlock_irqrestore(&pit_lock, flags);
+
+    // Null count. The new count hasn't been loaded into the counter yet.
+    if(status & 0x40) { return(0); }
+
+    // The output pin goes high when the count runs out.
+    if(status & 0x80)
+    {
+        return(programmed + ((0x10000 - count) & 0xFFFF));
+    }
+
+    if(count > programmed) { return(0); }
+    return(programmed - count);
 }
 
 //========================================================================================
-/* ... */
-uint32_t timer_interrupt_handler(uint32_t current_esp)
+/* Helper: Charges elapsed PIT counts to the clock, timer_wait() and the tasks. Call with the scheduler lock held. */
+static void timer_account(uint32_t counts)
 {
-    // Each tick is 10 milliseconds. (.01 seconds)
-    // 10 ticks is 100 milliseconds. (.10 seconds)
-    // 100 ticks is 1 second.
-    timer_ticks++;
+    timer_tick_counts += counts;
+    while(timer_tick_counts >= PIT_COUNTS_PER_TICK)
+    {
+        timer_tick_counts -= PIT_COUNTS_PER_TICK;
+        timer_ticks++;
+    }
 
     // Handle timer_wait counter.
-    if(timer_counter > 0) {
-        timer_counter--;
+    timer_wait_counts = (timer_wait_counts > counts) ? timer_wait_counts - counts : 0;
+
+    // Handle the sleeping tasks and the running task's time slice.
+    task_tick(counts);
+}
+
+//========================================================================================
+/* Helper: Starts the countdown to whatever needs the cpu first. Call with the scheduler lock held. */
+static void timer_start_next()
+{
+    uint32_t next = task_next_event();
+    if(timer_wait_counts && timer_wait_counts < next)
+    {
+        next = timer_wait_counts;
+    }
+    timer_start(next);
+}
+
+//========================================================================================
+/*
+ * Brings the clock up to date and restarts the countdown for the next event.
+ * Called when a new deadline may be earlier than the one the PIT is counting down to.
+ */
+void timer_sync()
+{
+    // The other cpus run their time slices off their own timers.
+    if(smp_cpu_index() != 0)
+    {
+        smp_timer_sync();
+        return;
     }
 
-    // Handle the ticks for any specific sleeping task.
-    task_tick();
+    uint32_t flags = sched_lock();
+
+    timer_account(timer_elapsed());
+    timer_start_next();
+
+    sched_unlock(flags);
+}
 
-    // Call the scheduler and return the (potentially new) stack pointer
-    return(schedule(current_esp));
+//========================================================================================
+/* Initialize the pit as a one-shot timer. There are no interrupts until something needs one. */
+void timer_init()
+{
+    timer_ticks = 0;
+    timer_tick_counts = 0;
+    timer_wait_counts = 0;
+    timer_start(PIT_MAX_COUNT);
+}
+
+//========================================================================================
+/* ... */
+uint32_t timer_interrupt_handler(uint32_t current_esp)
+{
+    uint32_t flags = sched_lock();
+
+    // Catch up with the time since the countdown was started.
+    // That wakes up any sleeping task whose time has come.
+    timer_account(timer_elapsed());
+
+    // Call the scheduler and get the (potentially new) stack pointer
+    uint32_t next_esp = schedule(current_esp);
+
+    // Count down to the next deadline, or the end of the new task's time slice.
+    timer_start_next();
+
+    sched_unlock(flags);
+    return(next_esp);
 }
 
 //========================================================================================
 /* Returns the current system uptime in ticks (10ms resolution) */
 uint32_t timer_get_ticks()
 {
-    return(timer_ticks);
+    uint32_t flags = sched_lock();
+    uint32_t ticks = timer_ticks + ((timer_tick_counts + timer_elapsed()) / PIT_COUNTS_PER_TICK);
+    sched_unlock(flags);
+    return(ticks);
+}
+
+//========================================================================================
+/* Returns the current system uptime in milliseconds */
+uint32_t timer_get_ms()
+{
+    uint32_t flags = sched_lock();
+    uint32_t ms = timer_now_ms();
+    sched_unlock(flags);
+    return(ms);
 }
 
 //========================================================================================
-/* 
+/* Returns the uptime in milliseconds. timer_get_ms() for callers that hold the scheduler lock. */
+uint32_t timer_now_ms()
+{
+    uint32_t counts = timer_tick_counts + timer_elapsed();
+    uint32_t ticks = timer_ticks + (counts / PIT_COUNTS_PER_TICK);
+    return((ticks * 10) + ((counts % PIT_COUNTS_PER_TICK) / PIT_COUNTS_PER_MS));
+}
+
+//========================================================================================
+/*
  * Blocks the whole cpu.
- * Wait for specified amount of time. 
- * A value of 100 is a second. 
+ * Wait for specified amount of time.
+ * A value of 100 is a second.
  */
 void timer_wait(uint32_t tc)
 {
-    asm volatile("cli");
-    timer_counter = tc;
-    asm volatile("sti");
-    while(timer_counter) 
-    { 
-        asm volatile("hlt");
+    uint32_t flags = sched_lock();
+    // The next update charges everything since the last one, so count from there.
+    timer_wait_counts = (tc * PIT_COUNTS_PER_TICK) + timer_elapsed();
+    sched_unlock(flags);
+
+    // Only the boot cpu's timer counts it down. It has to hear about it either way.
+    if(smp_cpu_index() != 0) { smp_send_resched(0); }
+    else                     { timer_sync(); }
+
+    while(timer_wait_counts)
+    {
+        asm volatile("pause");
     }
-}
\ No newline at end of file
+}
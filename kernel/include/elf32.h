@@ -33,6 +33,7 @@ struct ELF32_PHDR {
     uint32_t p_align;     // The required alignment for the segment in memory.
 }__attribute__((packed));
 
-extern uint32_t elf32_parse_and_relocate(uint8_t* );
+struct address_space;
+extern uint32_t elf32_parse_and_relocate(uint8_t*, struct address_space* );
 
 #endif // __ELF32_H
\ No newline at end of file
@@ -5,8 +5,8 @@
 #include <stdint.h>
 #include <stdarg.h>
 
-// I/O Port Offsets for Primary ATA Bus
-// These are offsets from the base port (0x1F0)
+// I/O Port Offsets for an ATA Bus
+// These are offsets from the channel's base port (0x1F0 primary, 0x170 secondary, or BAR0/BAR2 in native mode)
 #define ATA_REG_DATA       0x00
 #define ATA_REG_ERROR      0x01
 #define ATA_REG_FEATURES   0x01
@@ -18,7 +18,7 @@
 #define ATA_REG_STATUS     0x07
 #define ATA_REG_COMMAND    0x07
 
-// These are offsets from the control port (0x3F6)
+// These are offsets from the control port (0x3F6 primary, 0x376 secondary)
 #define ATA_REG_ALT_STATUS 0x00
 #define ATA_REG_DEV_CTRL   0x00
 
@@ -32,8 +32,42 @@
 // Commands
 #define ATA_CMD_READ_PIO   0x20
 #define ATA_CMD_WRITE_PIO  0x30
+#define ATA_CMD_READ_DMA   0xC8
+#define ATA_CMD_WRITE_DMA  0xCA
+#define ATA_CMD_READ_PIO_EXT  0x24
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_MULTIPLE      0xC4
+#define ATA_CMD_WRITE_MULTIPLE     0xC5
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE       0xC6
 #define ATA_CMD_IDENTIFY   0xEC
 
+// Bus master IDE registers. Offsets from BAR4, 8 ports per channel.
+#define BM_REG_COMMAND     0x00
+#define BM_REG_STATUS      0x02
+#define BM_REG_PRDT        0x04    // Physical address of the PRD table
+
+// Bus master command bits
+#define BM_CMD_START       0x01
+#define BM_CMD_READ        0x08    // The drive writes to memory
+
+// Bus master status bits
+#define BM_SR_ACTIVE       0x01
+#define BM_SR_ERR          0x02    // Write 1 to clear
+#define BM_SR_IRQ          0x04    // Write 1 to clear
+#define BM_SR_DRV0_DMA     0x20    // Set by firmware when the master can do DMA
+#define BM_SR_DRV1_DMA     0x40
+
+// Identify capabilities (word 49)
+#define ATA_CAP_DMA        0x0100
+#define ATA_CAP_LBA        0x0200
+
+// Identify command sets supported (word 83)
+#define ATA_CMDSET_LBA48   0x0400
+
 // Drive Selection
 #define ATA_SELECT_MASTER  0xA0
 #define ATA_SELECT_SLAVE   0xB0
@@ -57,8 +91,8 @@ struct ata_identify {
     uint16_t ecc_bytes_avail;       // Word 22
     uint16_t firmware_revision[4];  // Word 23-26
     uint16_t model_string[20];      // Word 27-46 (40 bytes)
-    uint16_t reserved47;            // Word 47
-    uint16_t doubleword;            // Word 48
+    uint16_t max_multiple;          // Word 47 (Bits 0-7 = most sectors per READ/WRITE MULTIPLE block)
+    uint16_t doubleword;            // Word 48 (ATA-1: Bit 0 = 32-bit data transfers)
     uint16_t capabilities;          // Word 49 (Bit 9 = LBA support)
     uint16_t reserved50;            // Word 50
     uint16_t pio_timing_mode;       // Word 51
@@ -68,16 +102,22 @@ struct ata_identify {
     uint16_t current_heads;         // Word 55
     uint16_t current_spt;           // Word 56
     uint16_t current_capacity[2];   // Word 57-58
-    uint16_t reserved59;            // Word 59
+    uint16_t multiple_setting;      // Word 59 (Bit 8 = valid, Bits 0-7 = current block size)
     uint32_t total_sectors_28bit;   // Word 60-61 (32-bit value)
-    uint16_t reserved62_82[21];     // Word 62-82
+    uint16_t reserved62;            // Word 62
+    uint16_t multiword_dma;         // Word 63 (Bits 0-2 = modes supported)
+    uint16_t reserved64_82[19];     // Word 64-82
     uint16_t command_sets_supported;// Word 83 (Bit 10 = LBA48 support)
-    uint16_t reserved84_99[16];     // Word 84-99
+    uint16_t reserved84_87[4];      // Word 84-87
+    uint16_t ultra_dma;             // Word 88 (Bits 0-6 = modes supported)
+    uint16_t reserved89_99[11];     // Word 89-99
     uint64_t total_sectors_48bit;   // Word 100-103 (64-bit value)
     // ...
 } __attribute__((packed));
 
-int ide_read_sectors(uint8_t, uint32_t, uint8_t, void* );
-int ide_write_sectors(uint8_t, uint32_t, uint8_t, void* );
+int ide_read_sectors(uint8_t, uint32_t, uint32_t, void* );
+int ide_write_sectors(uint8_t, uint32_t, uint32_t, void* );
+void ide_display_info();
+void ide_benchmark();
 
 #endif // __IDE_H
\ No newline at end of file
@@ -30,10 +30,24 @@ typedef struct {
 
 extern uint8_t main_memory_index;
 extern memory_region_t available_memory_map[];
+extern size_t mmap_avail_entry_count;
 extern uint64_t total_memory_size;
 
 extern void mmap_display_available();
 
+// FRAME.C =============================================================
+// Physical page frames are tracked in a bitmap. 1 = used/reserved, 0 = free.
+// Everything below 1MB belongs to the BIOS and our boot loader.
+#define FRAME_LOW_MEMORY_END    0x00100000
+
+extern uint32_t frame_alloc();
+extern uint32_t frame_alloc_contiguous(uint32_t);
+extern void frame_free(uint32_t);
+extern void frame_free_contiguous(uint32_t, uint32_t);
+extern uint32_t frame_free_count();
+extern uint32_t frame_memory_top();
+extern void frame_display_stats();
+
 // PAGING.C ============================================================
 #define PAGE_SIZE 4096
 
@@ -42,19 +56,76 @@ extern void mmap_display_available();
 #define PDE_READ_WRITE  0x02    // 1 = Read/Write,  0 = Read-only.
 #define PDE_USER        0x04    // 1 = User-mode,   0 = Supervisor-mode.
 #define PDE_4MB_PAGE    0x80    // 1 = Page is 4MB, 0 = Page is 4KB.
+#define PDE_GLOBAL      0x100   // 1 = 4MB page survives CR3 reloads. (CR4.PGE)
 
 // Page Table Entry (PTE) Flags.
 #define PTE_PRESENT     0x01    // 1 = Page is present
 #define PTE_READ_WRITE  0x02    // 1 = Read/Write, 0 = Read-only
 #define PTE_USER        0x04    // 1 = User-mode,  0 = Supervisor-mode
+#define PTE_WRITE_THROUGH 0x08  // 1 = Writes go straight to memory.
+#define PTE_CACHE_DISABLE 0x10  // 1 = Never cached. For memory mapped device registers.
+#define PTE_GLOBAL      0x100   // 1 = Page survives CR3 reloads. (CR4.PGE)
+#define PTE_COPY_ON_WRITE 0x200 // Available bit. Read-only shared page, copied on the first write.
+
+// Page fault error code bits.
+#define PF_PRESENT      0x01    // 1 = Protection violation, 0 = Page not present.
+#define PF_WRITE        0x02    // 1 = Write, 0 = Read.
 
 // For now we are just identity mapping to keep things simple.
 #define KERNEL_PHYSICAL_BASE 0x00100000 // As defined in link.ld
 #define KERNEL_VIRTUAL_BASE KERNEL_PHYSICAL_BASE
 
+// Everything below this is identity mapped at boot.
+extern uint32_t paging_identity_end;
+extern uint8_t  paging_large_pages;
+
+// PTE_GLOBAL when the cpu has PGE, otherwise 0. Kernel mappings should OR this in.
+extern uint32_t paging_global_flag;
+
+// A spare window for temporary mappings, like the alias used by paging_benchmark().
+#define PAGING_SCRATCH_BASE 0xE0000000
+
+// Each task with its own address space gets a private copy of this window for its program image.
+// The kernel address space leaves it unmapped, so the frames behind it are never handed out.
+// Pages of the window are backed on first touch by paging_handle_fault().
+#define USER_IMAGE_BASE     0x00300000
+#define USER_IMAGE_END      0x00400000
+
+// Every address space shares the kernel mappings. Only the program window is private.
+typedef struct address_space {
+    uint32_t* page_dir;         // Page directory. Lives in the identity map.
+    uint32_t* low_table;        // Private page table for the first 4MB, made on first touch.
+    struct address_space* next; // All address spaces, so new kernel page tables reach each of them.
+} address_space_t;
+
+extern int paging_map_page(uint32_t, uint32_t, uint32_t);
+extern uint32_t paging_unmap_page(uint32_t);
+extern int paging_protect_page(uint32_t, uint32_t);
+extern uint32_t paging_get_physical(uint32_t);
+extern void paging_invalidate_page(uint32_t);
+extern void paging_flush_tlb();
+extern address_space_t* paging_create_address_space();
+extern void paging_destroy_address_space(address_space_t*);
+extern void paging_switch_address_space(address_space_t*);
+extern uint32_t paging_alloc_user_page(address_space_t*, uint32_t, uint32_t);
+extern uint32_t paging_get_user_physical(address_space_t*, uint32_t);
+extern int paging_handle_fault(uint32_t);
+extern void paging_display_stats();
+extern void paging_benchmark();
+
 // HEAP.C ==============================================================
-// Define a minimum block size. (sizeof(malloc_t) [8] + 16) = 24 bytes.
-#define MIN_BLOCK_SPLIT (sizeof(malloc_t) + 16)
+// The heap lives in its own virtual window and is backed by page frames as it grows.
+#define KERNEL_HEAP_BASE        0xD0000000
+#define KERNEL_HEAP_MAX_SIZE    0x10000000  // 256MB
+#define KERNEL_HEAP_INITIAL     0x00040000  // 256KB
+
+// Every block carries a header and a footer (boundary tag) of sizeof(malloc_t).
+// Define a minimum block size. (header [8] + footer [8] + 16) = 32 bytes.
+#define MIN_BLOCK_SPLIT ((sizeof(malloc_t) * 2) + 16)
+
+// Free blocks are kept in segregated lists by power of two payload size.
+// Bin 0 holds 8-15 bytes, bin 1 holds 16-31 bytes, ... the last bin holds the rest.
+#define HEAP_BIN_COUNT  24
 
 struct HEAP_info {
     uint32_t base;
@@ -64,55 +135,309 @@ struct HEAP_info {
 }/*__attribute__((packed))*/;
 
 typedef struct {
-    uint32_t size;      // Size of the data payload (not including this header)
+    uint32_t size;      // Size of the data payload (not including header and footer)
     uint8_t reserved;   // 1 = used, 0 = free
     uint8_t padding[3]; // Pad struct to 8 bytes.
 } malloc_t; 
 
+// A free block stores its list links at the start of its payload.
+typedef struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+} free_block_t;
+
 extern void print_heap_info();
 extern void* malloc(size_t);
 extern void  free(void*);
+extern void heap_benchmark();
+
+// SLAB.C ==============================================================
+// A slab is one heap allocation carved into equal sized objects.
+struct slab {
+    struct slab* next;
+    uint32_t padding;       // Keep the objects that follow 8 byte aligned.
+};
+
+// Free objects are chained through their first word, so objects carry no header.
+typedef struct slab_cache {
+    char name[16];
+    size_t obj_size;
+    uint32_t objs_per_slab;
+    void* free_list;
+    struct slab* slabs;
+    uint32_t slab_count;
+    uint32_t total_objs;
+    uint32_t used_objs;
+    uint32_t alloc_count;
+    uint32_t free_count;
+    struct slab_cache* next;    // All caches, for slab_display_stats().
+} slab_cache_t;
+
+extern slab_cache_t* slab_cache_create(const char*, size_t, uint32_t);
+extern void  slab_cache_destroy(slab_cache_t*);
+extern void* slab_alloc(slab_cache_t*);
+extern void  slab_free(slab_cache_t*, void*);
+extern void  slab_display_stats();
 
 // TASK.C =============================================================
-#define MAX_TASKS   16
 #define STACK_SIZE  8192    // 4KB stack for new tasks
 
 // Define our new task states
-#define TASK_STATE_FREE     0   // Slot is free
+#define TASK_STATE_FREE     0   // Not set up yet
 #define TASK_STATE_RUNNING  1   // Task is active and running
 #define TASK_STATE_ZOMBIE   2   // Task has exited and is waiting to be "reaped"
 #define TASK_STATE_SLEEPING 3
+#define TASK_STATE_BLOCKED  4   // Waiting on a wait queue
+
+// task_yield() raises this software interrupt. It takes the same path as IRQ0.
+#define TASK_YIELD_VECTOR   0x30
+
+// Priorities. 0 is the highest. Runnable tasks wait in one queue per level.
+#define TASK_PRIORITY_LEVELS        32
+#define TASK_PRIORITY_INTERACTIVE   8
+#define TASK_PRIORITY_NORMAL        16
+#define TASK_PRIORITY_IDLE          31
+
+// Tasks are looked up by id through a hash with this many buckets. Must be a power of two.
+#define TASK_HASH_SIZE  64
 
 // Defines the state of a task.
 // For our software switch, we only need to store the stack pointer.
 // All other registers (eax, ebx, eip, eflags, etc.) are
 // saved onto this stack by the interrupt handler.
 struct task {
+    uint32_t id;            // Unique while the task exists. 0 is kernel_main.
     char name[24];          // ...
     uint32_t esp;           // Stack pointer for this task
     uint32_t stack_base;    // The original pointer from malloc, for freeing later
     uint8_t  state;         // 0 = inactive/free, 1 = active/running
-    uint32_t sleep_ticks;
+    uint32_t sleep_delta;   // PIT counts after the task before it in the sleep queue
+    address_space_t* space; // NULL = runs in the kernel's address space
+    uint8_t  priority;      // 0 = highest, TASK_PRIORITY_LEVELS-1 = lowest
+    uint32_t time_slice;    // Ticks the task may run before others of any priority get a turn
+    uint32_t slice_left;    // PIT counts left in the current time slice
+    struct task* next;      // Next task in the same run queue, or in the sleep queue
+    struct wait_queue* wait_queue;  // The wait queue we are blocked on
+    struct task* wait_next; // Next task on the same wait queue
+    uint8_t  in_sleep_queue;// 1 = a timed wait is also in the sleep queue
+    uint8_t  wait_timed_out;// 1 = the last wait ran out of time
+    struct task* hash_next; // Next task in the same id hash bucket
+    struct task* all_next;  // Next task in the list of all tasks
+    uint32_t preempt_count; // Nesting of preempt_disable(). Not 0 = keeps the cpu until it blocks
+    void* fpu_state;        // FPU/SSE save area. Handed out with the task, NULL without an FPU
+    uint8_t  fpu_used;      // 1 = the task has touched the FPU
+    uint8_t  cpu;           // The cpu whose run queues the task belongs to
+    volatile uint8_t on_cpu;// 1 = a cpu is still on its stack. Nobody else may switch to it
+    uint32_t run_ticks;     // Time spent on a cpu, in ticks
+    uint32_t run_counts;    // ... and PIT counts into the next tick
+    uint32_t switches;      // Times a cpu switched to it
+    uint32_t voluntary;     // Times it gave the cpu up itself, by blocking, sleeping or yielding
+    uint32_t involuntary;   // Times it was preempted
+    uint32_t sleep_ms;      // Time spent sleeping or blocked
+    uint32_t sleep_since;   // Uptime in ms when it last went to sleep or blocked
+    uint32_t last_run;      // Uptime in ms when it was last switched to
+    uint32_t top_mark;      // Its run time in PIT counts at the last task_display_top()
 }__attribute__((packed));
 
+// Tasks blocked until some event happens.
+typedef struct wait_queue {
+    struct task* head;
+    struct task* tail;
+} wait_queue_t;
+
+// Blocks the current task until condition is true.
+// Whoever can make it true has to wake the queue after doing so.
+// The condition is checked with the scheduler lock held, so it must not take it itself.
+#define wait_event(queue, condition) \
+    do { \
+        uint32_t wait_flags = sched_lock(); \
+        while(!(condition)) \
+        { \
+            wait_queue_wait((queue), 0); \
+        } \
+        sched_unlock(wait_flags); \
+    } while(0)
+
+// One list of runnable tasks per priority, and a bitmap of the lists that are not empty.
+typedef struct {
+    uint32_t bitmap;
+    struct task* head[TASK_PRIORITY_LEVELS];
+    struct task* tail[TASK_PRIORITY_LEVELS];
+} run_queue_t;
+
 extern volatile uint8_t tasking_enabled;
 
-extern int task_exec(void(*)(void), const char* );
+extern int task_exec(void(*)(void), const char*, uint8_t);
+extern int task_exec_space(void(*)(void), const char*, address_space_t*, uint8_t);
+extern void task_set_time_slice(uint32_t);
 extern uint32_t schedule(uint32_t);
+extern void task_yield();
+extern void task_benchmark();
 extern void task_kill();
 extern void task_list();
-extern void task_tick();
+extern void task_display_top();
+extern void task_tick(uint32_t);
+extern uint32_t task_next_event();
 extern void task_sleep(uint32_t);
-extern void reaper();
-extern void wait_for_task(const char* );
+extern void task_sleep_ms(uint32_t);
+extern void wait_for_task(uint32_t);
+extern struct task* task_find(uint32_t);
+extern uint32_t task_current_id();
+extern struct task* task_current();
+extern void preempt_disable();
+extern void preempt_enable();
+extern uint32_t sched_lock();
+extern void sched_unlock(uint32_t);
+extern struct task* task_create_idle(uint32_t);
+extern void task_switch_finish();
+extern void wait_queue_init(wait_queue_t*);
+extern int  wait_queue_wait(wait_queue_t*, uint32_t);
+extern void wait_queue_wake_one(wait_queue_t*);
+extern void wait_queue_wake_all(wait_queue_t*);
+
+// SYNC.C =============================================================
+// A busy-waiting lock for data shared between cpus and interrupt handlers.
+// Interrupts stay off on this cpu while it is held. Zeroed = unlocked.
+typedef struct spinlock {
+    volatile uint32_t locked;
+} spinlock_t;
+
+extern uint32_t spin_lock_irqsave(spinlock_t*);
+extern void spin_unlock_irqrestore(spinlock_t*, uint32_t);
+extern void spin_lock(spinlock_t*);
+extern void spin_unlock(spinlock_t*);
+
+// A sleeping lock. Tasks that find it taken block instead of spinning or masking interrupts.
+// Never take one in an interrupt handler.
+typedef struct mutex {
+    char name[16];
+    volatile uint8_t locked;
+    uint32_t owner;             // Id of the task holding it
+    wait_queue_t waiters;
+    uint32_t acquisitions;      // Times it was taken
+    uint32_t contentions;       // Times someone had to wait for it
+    struct mutex* next;         // All mutexes, for sync_display_stats().
+} mutex_t;
+
+// A counting semaphore. down() blocks while the count is 0. up() may be called from interrupts.
+typedef struct semaphore {
+    char name[16];
+    volatile uint32_t count;
+    wait_queue_t waiters;
+    uint32_t acquisitions;
+    uint32_t contentions;
+    struct semaphore* next;
+} semaphore_t;
+
+extern void mutex_init(mutex_t*, const char*);
+extern void mutex_lock(mutex_t*);
+extern int  mutex_trylock(mutex_t*);
+extern void mutex_unlock(mutex_t*);
+// A set of event bits. Whoever waits clears the bits it asked for. signal() may be called from interrupts.
+typedef struct event {
+    volatile uint32_t pending;
+    wait_queue_t waiters;
+} event_t;
+
+extern void semaphore_init(semaphore_t*, const char*, uint32_t);
+extern void semaphore_down(semaphore_t*);
+extern int  semaphore_trydown(semaphore_t*);
+extern void semaphore_up(semaphore_t*);
+extern void event_init(event_t*);
+extern void event_signal(event_t*, uint32_t);
+extern uint32_t event_wait(event_t*, uint32_t);
+extern void sync_display_stats();
+
+// FPU.C ==============================================================
+// x87/SSE state is switched lazily through CR0.TS and the #NM trap.
+extern void fpu_init();
+extern void fpu_init_ap();
+extern void fpu_switch(struct task*, struct task*);
+extern int  fpu_handle_trap();
+extern int  fpu_task_init(struct task*);
+extern void fpu_task_exit(struct task*);
+extern void fpu_display_stats();
+
+// ACPI.C =============================================================
+// What the MADT told us about the interrupt controllers.
+#define ACPI_MAX_CPUS   32
+
+typedef struct {
+    uint32_t lapic_addr;                // Physical address of every cpu's local APIC
+    uint32_t cpu_count;                 // Enabled processors
+    uint8_t  apic_ids[ACPI_MAX_CPUS];   // Local APIC id of each, the boot cpu among them
+    uint32_t ioapic_count;
+    uint32_t ioapic_addr;               // The first IOAPIC
+    uint32_t overrides;                 // ISA interrupt source overrides
+} acpi_madt_t;
+
+extern acpi_madt_t acpi_madt;
+extern int acpi_init();
+
+// SMP.C ==============================================================
+#define SMP_MAX_CPUS    8
+
+// Interrupt vectors of the local APIC.
+#define SMP_TIMER_VECTOR    0x31    // LAPIC timer of the application processors
+#define SMP_RESCHED_VECTOR  0x32    // Another cpu wants us to run the scheduler
+#define SMP_TLB_VECTOR      0x33    // Another cpu changed a kernel mapping
+#define SMP_SPURIOUS_VECTOR 0xFF
+
+// Everything the scheduler keeps per cpu. Guarded by the scheduler lock.
+typedef struct cpu {
+    uint32_t index;             // 0 is the boot cpu
+    uint8_t  apic_id;
+    volatile uint8_t online;
+    struct task* volatile current;
+    struct task* prev;          // The task we switched away from, until we are off its stack
+    struct task* idle;          // Runs when nothing else can. Never in a run queue
+    run_queue_t run_queues[2];
+    run_queue_t* active;
+    run_queue_t* expired;
+    uint32_t queued;            // Tasks in our run queues
+    volatile uint8_t yield_requested;   // Set by task_yield()
+    volatile uint8_t preempt_pending;   // The scheduler wanted the cpu while preemption was off
+    uint32_t steals;            // Tasks we took from other cpus
+    uint32_t lapic_programmed;  // LAPIC timer count the one-shot was last started with
+    uint32_t ipis;              // Reschedule IPIs received
+} cpu_t;
+
+extern cpu_t smp_cpus[];
+extern volatile uint32_t smp_cpu_count;
+extern void smp_init();
+extern uint32_t smp_cpu_index();
+extern cpu_t* smp_cpu();
+extern void smp_send_resched(uint32_t);
+extern void smp_timer_sync();
+extern void smp_tlb_shootdown(uint32_t);
+extern void smp_display_cpus();
+
+// CLOCK.C ============================================================
+// The TSC, calibrated against the PIT at boot. Falls back to the PIT without a TSC.
+extern void clock_init();
+extern uint32_t clock_get_khz();
+extern uint64_t clock_get_cycles();
+extern uint64_t clock_cycles_to_ns(uint64_t);
+extern uint64_t clock_get_ns();
+extern uint32_t clock_get_ms();
+extern void ndelay(uint32_t);
+extern void udelay(uint32_t);
+extern void clock_display_uptime();
 
 // KERNEL.ASM =========================================================
 extern void SYSTEM_HALT();
 extern uint32_t EFLAGS_VALUE();
+extern uint64_t READ_TSC();
 
 // KERNEL.C ===========================================================
 extern void kernel_main();
 
+// IDT.ASM ============================================================
+extern void IDT_SET_GATE(void (*)(), uint32_t);
+
+// IRQ.ASM ============================================================
+extern void IDE_NATIVE_IRQ_HANDLER();
+
 // IO.ASM =============================================================
 extern uint8_t  INB(uint16_t);
 extern void     OUTB(uint16_t, uint8_t);
@@ -120,5 +445,9 @@ extern uint16_t INW(uint16_t);
 extern void     OUTW(uint16_t, uint16_t);
 extern uint32_t INL(uint16_t);
 extern void     OUTL(uint16_t, uint32_t);
+extern void     INSW(uint16_t, void*, uint32_t);
+extern void     OUTSW(uint16_t, const void*, uint32_t);
+extern void     INSL(uint16_t, void*, uint32_t);
+extern void     OUTSL(uint16_t, const void*, uint32_t);
 
 #endif // __KERNEL_H
\ No newline at end of file
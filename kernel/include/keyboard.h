@@ -21,10 +21,18 @@
 #define right_shift_released    0xb6
 #define caps_lock_released      0xba
 
-extern uint8_t f12_pressed;
+// Hotkeys are signaled on keyboard_hotkeys instead of landing in the input buffer.
+#define KEYBOARD_HOTKEY_F12     0x01    // Starts the kernel shell.
 
 extern volatile char keyboard_input_buffer[];
 
 extern void keyboard_reset_buffer();
 
+// Woken whenever something lands in keyboard_input_buffer.
+struct wait_queue;
+extern struct wait_queue keyboard_wait_queue;
+
+struct event;
+extern struct event keyboard_hotkeys;
+
 #endif // __KEYBOARD_H
\ No newline at end of file
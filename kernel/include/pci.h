@@ -9,6 +9,11 @@
 #define CONFIG_ADDRESS 0xCF8
 #define CONFIG_DATA    0xCFC
 
+// Command register bits.
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_MEMORY      0x0002
+#define PCI_COMMAND_BUS_MASTER  0x0004
+
 struct _pci_device_hdr {
     uint16_t device_id;
     uint16_t vendor_id;
@@ -40,11 +45,18 @@ struct _pci_device_hdr {
     uint8_t  min_grant;
     uint8_t  int_pin;
     uint8_t  int_line;
+    // Not part of the header. Where the function lives, so it can be written to.
+    uint8_t  bus;
+    uint8_t  slot;
+    uint8_t  func;
 }__attribute__((packed));
 
 extern struct _pci_device_hdr pci_device_hdr[];
 
+extern uint32_t pci_conf_read_dword(uint8_t, uint8_t, uint8_t, uint8_t);
+extern void pci_conf_write_dword(uint8_t, uint8_t, uint8_t, uint8_t, uint32_t);
 extern void pci_probe_devices();
+extern void pci_enable_bus_master(struct _pci_device_hdr*);
 extern void pci_conf_display();
 
 #endif  // __PCI_H
\ No newline at end of file
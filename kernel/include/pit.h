@@ -4,7 +4,19 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// The PIT counts down at 1,193,182 Hz. It is run one-shot, so these are the units we work in.
+#define PIT_FREQUENCY       1193182
+#define PIT_COUNTS_PER_TICK 11932   // One tick is 10ms.
+#define PIT_COUNTS_PER_MS   1193
+#define PIT_MAX_COUNT       0xFFFF  // The longest countdown, about 55ms.
+#define PIT_MIN_COUNT       60      // About 50us. Anything shorter just costs interrupts.
+
 extern void timer_wait(uint32_t);
 extern uint32_t timer_get_ticks();
+extern uint32_t timer_get_ms();
+extern uint32_t timer_now_ms();
+extern uint32_t timer_elapsed();
+extern void timer_sync();
+extern uint32_t timer_interrupt_handler(uint32_t);
 
-#endif  // __PIT_H
\ No newline at end of file
+#endif  // __PIT_H_
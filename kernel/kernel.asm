@@ -13,19 +13,24 @@ extern vga_init
 extern vga_prints
 extern draw_logo
 extern memory_map_init
+extern frame_init
 extern REMAP_PICS
 extern IDT_INIT
 extern paging_init
 extern timer_init
+extern clock_init
 extern keyboard_init
 extern heap_init
+extern fpu_init
 extern ide_init
 extern fat32_init
 extern serial_init
 extern tasking_init
+extern smp_init
 extern kernel_task
 global SYSTEM_HALT
 global EFLAGS_VALUE
+global READ_TSC
 
 ;=============================================================================================
 
@@ -68,6 +73,14 @@ KERNEL_INIT:
     call vga_prints
     add  esp, 12
 
+    ; Build the page frame allocator from the memory map.
+    push dword str_frame_init
+    call vga_prints
+    call frame_init
+    push dword str_okay
+    call vga_prints
+    add  esp, 8
+
     ; Initialize interrupts and service routines.
     push dword str_intr_init
     call vga_prints
@@ -85,7 +98,7 @@ KERNEL_INIT:
     mov  eax, [page_dir_phys_addr]
     mov  cr3, eax
     mov  eax, cr0
-    or   eax, 0x80000000     ; Enable the PG (Paging) bit in CR0
+    or   eax, 0x80010000     ; Enable the PG (Paging) and WP (Write Protect) bits in CR0
     mov  cr0, eax
     jmp .AFTER_PAGING
 .AFTER_PAGING:
@@ -102,6 +115,14 @@ KERNEL_INIT:
     call vga_prints
     add  esp, 8
 
+    ; Calibrate the TSC against the pit.
+    push dword str_clock_init
+    call vga_prints
+    call clock_init
+    push dword str_okay
+    call vga_prints
+    add  esp, 8
+
     ; Initialize keyboard driver.
     push dword str_kbd_init
     call vga_prints
@@ -121,6 +142,14 @@ KERNEL_INIT:
     call vga_prints
     add  esp, 8
 
+    ; Turn on the FPU and SSE. Their registers are switched lazily, per task.
+    push dword str_fpu_init
+    call vga_prints
+    call fpu_init
+    push dword str_okay
+    call vga_prints
+    add  esp, 8
+
     ; Initialize the IDE driver.
     push dword str_ide_init
     call vga_prints
@@ -153,6 +182,14 @@ KERNEL_INIT:
     call vga_prints
     add  esp, 8
 
+    ; Start the other processors. Each one needs an idle task, so this comes after tasking.
+    push dword str_smp_init
+    call vga_prints
+    call smp_init
+    push dword str_okay
+    call vga_prints
+    add  esp, 8
+
     ; This will be TASK[0]. Our main task.
     call kernel_task
 
@@ -175,21 +212,32 @@ EFLAGS_VALUE:
     pop eax         ; Pop it into EAX to return it
     ret
 
+;=============================================================================================
+
+; Returns the 64-bit time stamp counter in edx:eax.
+READ_TSC:
+    rdtsc           ; Loads the TSC into edx:eax
+    ret
+
 ;=============================================================================================
 section .rodata
 
 str_os_name:    db "eScheel OS",0xa,0
 str_kern_init:  db "Initializing the kernel:",0xa,0
 str_mmap_init:  db "  bios memory map .... ",0
+str_frame_init: db "  page frames ........ ",0
 str_intr_init:  db "  interrupts ......... ",0
 str_page_init:  db "  identity paging .... ",0
 str_pit_init:   db "  pit timer .......... ",0
+str_clock_init: db "  clocksource ........ ",0
 str_kbd_init:   db "  keyboard driver .... ",0
 str_heap_init:  db "  system heap ........ ",0
+str_fpu_init:   db "  fpu / sse .......... ",0
 str_ide_init:   db "  ide driver ......... ",0
 str_fat32_init: db "  fat32 driver ....... ",0
 str_rs232_init: db "  serial driver ...... ",0
 str_task_init:  db "  multi-tasking ...... ",0
+str_smp_init:   db "  smp ................ ",0
 str_okay:       db "[OK]",0xa,0
 str_halted:     db "System Halted ...",0
 
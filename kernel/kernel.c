@@ -19,21 +19,13 @@ void kernel_task()
     kprintf("Initialization complete!\nPress the F12 key to start the kernel shell.");
     while(1)
     {
-        // Was the f12 key pressed?
-        if(f12_pressed)
+        // Sleep until a hotkey is pressed. With nothing else to run the cpu sits in hlt.
+        uint32_t hotkeys = event_wait(&keyboard_hotkeys, KEYBOARD_HOTKEY_F12);
+
+        // Is the kernel shell already active?
+        if((hotkeys & KEYBOARD_HOTKEY_F12) && !kshell_activated)
         {
-            f12_pressed = 0;
-            // Is the kernel shell already active?
-            if(!kshell_activated)
-            {
-                task_exec(kshell, "kshell");
-            }
+            task_exec(kshell, "kshell", TASK_PRIORITY_INTERACTIVE);
         }
-
-        // Do some cleaning.
-        reaper();
-
-        // Sleep for a bit.
-        asm volatile("hlt");
     }
 }
@@ -2,6 +2,8 @@
 #include <vga.h>
 #include <pit.h>
 #include <pci.h>
+#include <ide.h>
+#include <keyboard.h>
 #include <fat32.h>
 #include <elf32.h>
 #include <io.h>
@@ -10,10 +12,20 @@
 
 uint8_t kshell_activated;
 
+// How often top redraws the screen.
+#define KSHELL_TOP_REFRESH_MS   1000
+
+// Line buffers for the shell. Kept around between shell sessions.
+static slab_cache_t* line_cache;
+
 /* ... */
 void kshell()
 {
-    char* s = (char*)malloc(1024);
+    if(!line_cache)
+    {
+        line_cache = slab_cache_create("kshell_line", 1024, 2);
+    }
+    char* s = (char*)slab_alloc(line_cache);
     vga_enable_cursor();
 
     kshell_activated = 1;
@@ -34,10 +46,21 @@ void kshell()
                 kprintf("\n  clear    (Clears the console screen)");
                 kprintf("\n  ls       (List the contents of the root directory.)");
                 kprintf("\n  read     (Display the contents of a file.)");
+                kprintf("\n  exec     (Runs an elf program in its own address space.)");
                 kprintf("\n  heapstat (Prints current heap information.)");
+                kprintf("\n  heapbench (Times malloc and free against a full heap walk.)");
+                kprintf("\n  slabstat (Prints the object caches.)");
+                kprintf("\n  pagebench (Times 4MB identity pages against 4KiB pages.)");
                 kprintf("\n  memmap   (Displays the regions of available memory.)");
                 kprintf("\n  pciconf  (List devices captured on the pci bus.)");
+                kprintf("\n  disks    (Displays the ide drives and how they are driven.)");
+                kprintf("\n  diskbench (Times 1MB reads from ide0 with PIO, READ MULTIPLE and DMA.)");
                 kprintf("\n  tasklist (Displays a list of currently running tasks.)");
+                kprintf("\n  top      (Shows the busiest tasks every second until a key is pressed.)");
+                kprintf("\n  ctxbench (Times task switches between two tasks.)");
+                kprintf("\n  cpus     (Displays the processors and their run queues.)");
+                kprintf("\n  locks    (Displays lock contention statistics.)");
+                kprintf("\n  uptime   (Displays the time since boot.)");
                 kprintf("\n  exit     (Exits the kernel shell.)");
             }
 
@@ -86,16 +109,76 @@ void kshell()
                 free(file_name);
             }
 
+            else if(strncmp(s, "exec", strlen("exec"))==0)
+            {
+                kprintf("\n");
+
+                // Allocate a buffer for the file name.
+                char* file_name = (char* )malloc(strlen(s));
+                memset(file_name, 0, strlen(s));
+
+                // Fill in the allocated file name.
+                for(unsigned int i=0,n=5; n<strlen(s); i++,n++)
+                {
+                    file_name[i] = s[n];
+                }
+
+                // Read the program into memory and load it into a fresh address space.
+                file_t* fp = fat32_read(file_name);
+                if(fp)
+                {
+                    address_space_t* space = paging_create_address_space();
+                    uint32_t entry = space ? elf32_parse_and_relocate(fp->data, space) : 0xfffffffd;
+                    if(entry >= 0xfffffffd)
+                    {
+                        kprintf("Unable to load [%s] (%xh)\n", file_name, entry);
+                        paging_destroy_address_space(space);
+                    }
+                    else if(task_exec_space((void(*)(void))entry, file_name, space, TASK_PRIORITY_NORMAL) < 0)
+                    {
+                        kprintf("Unable to start [%s]\n", file_name);
+                        paging_destroy_address_space(space);
+                    }
+                    free(fp);
+                }
+                else 
+                {
+                    kprintf("No such file [%s]\n", file_name);
+                }
+                free(file_name);
+            }
+
             else if(strncmp(s, "heapstat", strlen(s))==0 && strlen(s) == 8)
             {
                 kprintf("\n");
                 print_heap_info();
+                frame_display_stats();
+            }
+
+            else if(strncmp(s, "heapbench", strlen(s))==0 && strlen(s) == 9)
+            {
+                kprintf("\n");
+                heap_benchmark();
+            }
+
+            else if(strncmp(s, "slabstat", strlen(s))==0 && strlen(s) == 8)
+            {
+                kprintf("\n");
+                slab_display_stats();
+            }
+
+            else if(strncmp(s, "pagebench", strlen(s))==0 && strlen(s) == 9)
+            {
+                kprintf("\n");
+                paging_benchmark();
             }
 
             else if(strncmp(s, "memmap", strlen(s))==0 && strlen(s) == 6)
             {
                 kprintf("\n");
                 mmap_display_available();
+                frame_display_stats();
+                paging_display_stats();
             }
 
             else if(strncmp(s, "pciconf", strlen(s))==0 && strlen(s) == 7)
@@ -104,6 +187,36 @@ void kshell()
                 pci_conf_display();
             }
 
+            else if(strncmp(s, "disks", strlen(s))==0 && strlen(s) == 5)
+            {
+                kprintf("\n");
+                ide_display_info();
+            }
+
+            else if(strncmp(s, "diskbench", strlen(s))==0 && strlen(s) == 9)
+            {
+                kprintf("\n");
+                ide_benchmark();
+            }
+
+            else if(strncmp(s, "ctxbench", strlen(s))==0 && strlen(s) == 8)
+            {
+                kprintf("\n");
+                task_benchmark();
+            }
+
+            else if(strncmp(s, "locks", strlen(s))==0 && strlen(s) == 5)
+            {
+                kprintf("\n");
+                sync_display_stats();
+            }
+
+            else if(strncmp(s, "uptime", strlen(s))==0 && strlen(s) == 6)
+            {
+                kprintf("\n");
+                clock_display_uptime();
+            }
+
             else if((strncmp(s, "tasklist", strlen(s))==0 && strlen(s) == 8) \
                  || (strncmp(s, "ps",       strlen(s))==0 && strlen(s) == 2))
             {
@@ -111,6 +224,33 @@ void kshell()
                 task_list();
             }
 
+            else if(strncmp(s, "top", strlen(s))==0 && strlen(s) == 3)
+            {
+                // Redraw until a key lands in the input buffer. kgets() clears it again.
+                keyboard_reset_buffer();
+                while(!keyboard_input_buffer[0])
+                {
+                    vga_clear();
+                    kprintf("top - ");
+                    clock_display_uptime();
+                    task_display_top();
+                    kprintf("(press any key to quit)");
+
+                    uint32_t flags = sched_lock();
+                    if(!keyboard_input_buffer[0])
+                    {
+                        wait_queue_wait(&keyboard_wait_queue, KSHELL_TOP_REFRESH_MS);
+                    }
+                    sched_unlock(flags);
+                }
+            }
+
+            else if(strncmp(s, "cpus", strlen(s))==0 && strlen(s) == 4)
+            {
+                kprintf("\n");
+                smp_display_cpus();
+            }
+
             else if(strncmp(s, "exit", strlen(s))==0 && strlen(s) == 4)
             {
                 break;
@@ -125,6 +265,6 @@ void kshell()
     kshell_activated = 0;
 
     vga_disable_cursor();
-    free(s);
+    slab_free(line_cache, s);
     task_kill();
 }
\ No newline at end of file
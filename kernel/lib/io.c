@@ -1,11 +1,26 @@
+#include <kernel.h>
 #include <io.h>
 #include <keyboard.h>
 #include <vga.h>
 
+// Keeps the lines of different cpus apart. A fault in the middle of a kprintf() may still print.
+static spinlock_t kprintf_lock;
+static volatile uint32_t kprintf_owner = 0xFFFFFFFF;
+
 //========================================================================================
 /* A simple kernel-level printf implementation. */
 void kprintf(const char *fmt, ...)
 {
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+    uint32_t cpu = smp_cpu_index();
+    uint8_t nested = (kprintf_owner == cpu);
+    if(!nested)
+    {
+        spin_lock(&kprintf_lock);
+        kprintf_owner = cpu;
+    }
+
     va_list args;
     va_start(args, fmt);
 
@@ -69,6 +84,13 @@ void kprintf(const char *fmt, ...)
     }
 
     va_end(args);
+
+    if(!nested)
+    {
+        kprintf_owner = 0xFFFFFFFF;
+        spin_unlock(&kprintf_lock);
+    }
+    if(ints_enabled) { asm volatile("sti"); }
 }
 
 //========================================================================================
@@ -83,9 +105,7 @@ void kgets(char *s)
     while(1)
     {
         // Wait for a character to be pressed.
-        while(!keyboard_input_buffer[i]) {
-            asm volatile("hlt"); 
-        }
+        wait_event(&keyboard_wait_queue, keyboard_input_buffer[i]);
 
         // If return is pressed, we are done.
         if(keyboard_input_buffer[i] == '\n') { break; }
@@ -0,0 +1,188 @@
+#include <kernel.h>
+#include <io.h>
+#include <string.h>
+
+/*
+ * Just enough ACPI to find the processors. The RSDP points to the RSDT, the RSDT points
+ * to every other table, and the MADT ("APIC") lists the local APICs and IOAPICs.
+ * Nothing here is ever written, and nothing is unmapped again.
+ */
+
+// Root System Description Pointer. Found by its signature on a 16 byte boundary.
+struct acpi_rsdp {
+    char     signature[8];      // "RSD PTR "
+    uint8_t  checksum;          // The first 20 bytes add up to 0
+    char     oem_id[6];
+    uint8_t  revision;          // 0 = ACPI 1.0, 2 = ACPI 2.0+ (also has an XSDT)
+    uint32_t rsdt_address;
+}__attribute__((packed));
+
+// Every other table starts with this header. The whole table adds up to 0.
+struct acpi_sdt_header {
+    char     signature[4];
+    uint32_t length;            // Including the header
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+}__attribute__((packed));
+
+// Multiple APIC Description Table. Variable length entries follow it.
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+}__attribute__((packed));
+
+// MADT entry types.
+#define MADT_LAPIC              0
+#define MADT_IOAPIC             1
+#define MADT_INT_OVERRIDE       2
+#define MADT_LAPIC_ADDR_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED      0x01
+
+// Where the BIOS keeps the segment of the EBDA, and the BIOS ROM area.
+#define ACPI_EBDA_SEGMENT_PTR   0x040E
+#define ACPI_BIOS_AREA_START    0x000E0000
+#define ACPI_BIOS_AREA_END      0x00100000
+
+acpi_madt_t acpi_madt;
+
+//========================================================================================
+/* Helper: Returns 1 if length bytes at p add up to 0. */
+static int acpi_checksum_ok(const void* p, uint32_t length)
+{
+    const uint8_t* bytes = (const uint8_t*)p;
+    uint8_t sum = 0;
+    for(uint32_t i=0; i<length; i++)
+    {
+        sum += bytes[i];
+    }
+    return(sum == 0);
+}
+
+//========================================================================================
+/*
+ * Helper: Makes sure a table above the identity map can be read. Tables usually sit just
+ * below the top of memory, which is identity mapped already. Returns 0 on success.
+ */
+static int acpi_map(uint32_t phys, uint32_t length)
+{
+    for(uint32_t page = phys & 0xFFFFF000; page < phys + length; page += PAGE_SIZE)
+    {
+        if(page < paging_identity_end || paging_get_physical(page) == page) { continue; }
+        if(paging_map_page(page, page, paging_global_flag) != 0) { return(-1); }
+    }
+    return(0);
+}
+
+//========================================================================================
+/* Helper: Looks for the RSDP in a range of low memory. Returns NULL if it isn't there. */
+static struct acpi_rsdp* acpi_scan_rsdp(uint32_t start, uint32_t end)
+{
+    for(uint32_t addr = start; addr + sizeof(struct acpi_rsdp) <= end; addr += 16)
+    {
+        struct acpi_rsdp* rsdp = (struct acpi_rsdp*)addr;
+        if(strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(rsdp, sizeof(struct acpi_rsdp)))
+        {
+            return(rsdp);
+        }
+    }
+    return(NULL);
+}
+
+//========================================================================================
+/* Helper: Maps and checks the table at phys. Returns NULL if it is no good. */
+static struct acpi_sdt_header* acpi_get_table(uint32_t phys)
+{
+    if(!phys || acpi_map(phys, sizeof(struct acpi_sdt_header)) != 0) { return(NULL); }
+
+    struct acpi_sdt_header* header = (struct acpi_sdt_header*)phys;
+    if(header->length < sizeof(struct acpi_sdt_header)) { return(NULL); }
+    if(acpi_map(phys, header->length) != 0) { return(NULL); }
+    if(!acpi_checksum_ok(header, header->length)) { return(NULL); }
+    return(header);
+}
+
+//========================================================================================
+/* Helper: Records what the MADT says. */
+static void acpi_parse_madt(struct acpi_madt* madt)
+{
+    acpi_madt.lapic_addr = madt->lapic_addr;
+
+    uint8_t* entry = (uint8_t*)madt + sizeof(struct acpi_madt);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while(entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end)
+    {
+        switch(entry[0])
+        {
+            case MADT_LAPIC:
+                // processor id, apic id, flags
+                if((*(uint32_t*)&entry[4] & MADT_LAPIC_ENABLED) && acpi_madt.cpu_count < ACPI_MAX_CPUS)
+                {
+                    acpi_madt.apic_ids[acpi_madt.cpu_count++] = entry[3];
+                }
+                break;
+            case MADT_IOAPIC:
+                // id, reserved, address, global interrupt base
+                if(acpi_madt.ioapic_count == 0)
+                {
+                    acpi_madt.ioapic_addr = *(uint32_t*)&entry[4];
+                }
+                acpi_madt.ioapic_count++;
+                break;
+            case MADT_INT_OVERRIDE:
+                acpi_madt.overrides++;
+                break;
+            case MADT_LAPIC_ADDR_OVERRIDE:
+                // A 64-bit address. We can only use it below 4GB.
+                if(*(uint32_t*)&entry[8] == 0)
+                {
+                    acpi_madt.lapic_addr = *(uint32_t*)&entry[4];
+                }
+                break;
+        }
+        entry += entry[1];
+    }
+}
+
+//========================================================================================
+/* Finds the MADT. Returns 0 if it was found, -1 if there is no usable ACPI. */
+int acpi_init()
+{
+    memset(&acpi_madt, 0, sizeof(acpi_madt));
+
+    // The first KiB of the EBDA, then the BIOS ROM area.
+    struct acpi_rsdp* rsdp = NULL;
+    uint32_t ebda = (uint32_t)(*(uint16_t*)ACPI_EBDA_SEGMENT_PTR) << 4;
+    if(ebda >= 0x80000 && ebda < 0xA0000)
+    {
+        rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    }
+    if(!rsdp)
+    {
+        rsdp = acpi_scan_rsdp(ACPI_BIOS_AREA_START, ACPI_BIOS_AREA_END);
+    }
+    if(!rsdp) { return(-1); }
+
+    // The RSDT is a header and an array of 32-bit table addresses.
+    struct acpi_sdt_header* rsdt = acpi_get_table(rsdp->rsdt_address);
+    if(!rsdt || strncmp(rsdt->signature, "RSDT", 4) != 0) { return(-1); }
+
+    uint32_t count = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
+    uint32_t* tables = (uint32_t*)((uint8_t*)rsdt + sizeof(struct acpi_sdt_header));
+    for(uint32_t i=0; i<count; i++)
+    {
+        struct acpi_sdt_header* table = acpi_get_table(tables[i]);
+        if(table && strncmp(table->signature, "APIC", 4) == 0)
+        {
+            acpi_parse_madt((struct acpi_madt*)table);
+            return(acpi_madt.cpu_count ? 0 : -1);
+        }
+    }
+    return(-1);
+}
@@ -0,0 +1,225 @@
+#include <kernel.h>
+#include <pit.h>
+#include <io.h>
+
+/*
+ * The TSC counts cpu cycles. We time it against the PIT once at boot and from then on
+ * turn cycles into time with a multiply and a shift. No 64-bit divides needed.
+ */
+
+// CPUID.01h:EDX feature bit.
+#define CPUID_FEATURE_TSC   (1 << 4)
+
+// Each calibration run times the TSC over this many PIT counts. 11932 counts is 10ms.
+#define CLOCK_CALIBRATE_COUNTS  PIT_COUNTS_PER_TICK
+#define CLOCK_CALIBRATE_MS      10
+#define CLOCK_CALIBRATE_RUNS    3
+
+// Cycles per millisecond. 0 if there is no TSC, and we fall back to the PIT.
+static uint32_t clock_tsc_khz;
+
+// The TSC at boot. Uptime counts from here.
+static uint64_t clock_tsc_base;
+
+// cycles -> ns, cycles -> ms and ns -> cycles as (value * mult) >> shift.
+#define CLOCK_NS_SHIFT      22
+#define CLOCK_MS_SHIFT      40
+#define CLOCK_CYCLES_SHIFT  20
+static uint32_t clock_ns_mult;
+static uint32_t clock_ms_mult;
+static uint32_t clock_cycles_mult;
+
+//========================================================================================
+/* Helper: Returns (num << shift) / den with 32-bit math only. */
+static uint32_t clock_scale(uint32_t num, uint32_t den, uint32_t shift)
+{
+    uint32_t quotient = num / den;
+    uint32_t remainder = num % den;
+
+    // Long division, one bit at a time.
+    for(uint32_t i=0; i<shift; i++)
+    {
+        quotient <<= 1;
+        remainder <<= 1;
+        if(remainder >= den)
+        {
+            remainder -= den;
+            quotient |= 1;
+        }
+    }
+    return(quotient);
+}
+
+//========================================================================================
+/* Helper: Returns (value * mult) >> shift without losing the top of the product. */
+static uint64_t clock_mul_shift(uint64_t value, uint32_t mult, uint32_t shift)
+{
+    uint64_t high = (value >> 32) * mult;
+    uint64_t low  = (uint64_t)(uint32_t)value * mult;
+    if(shift >= 32)
+    {
+        return((high >> (shift - 32)) + (low >> shift));
+    }
+    return((high << (32 - shift)) + (low >> shift));
+}
+
+//========================================================================================
+/* Helper: Times the TSC over one PIT channel 2 countdown. Call with interrupts disabled. */
+static uint32_t clock_calibrate_once()
+{
+    // Gate channel 2 on, but keep the speaker off.
+    OUTB(0x61, (INB(0x61) & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary.
+    // The output shows up in bit 5 of port 0x61 once the count runs out.
+    OUTB(0x43, 0xB0);
+    OUTB(0x42, CLOCK_CALIBRATE_COUNTS & 0xFF);
+    OUTB(0x42, CLOCK_CALIBRATE_COUNTS >> 8);
+
+    uint64_t start = READ_TSC();
+    while(!(INB(0x61) & 0x20)) { continue; }
+    uint64_t end = READ_TSC();
+
+    return((uint32_t)(end - start));
+}
+
+//========================================================================================
+/* Calibrates the TSC against the PIT. */
+void clock_init()
+{
+    clock_tsc_khz = 0;
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if(!(edx & CPUID_FEATURE_TSC)) { return; }
+
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+
+    // Anything that gets in the way only makes a run longer, so keep the shortest.
+    uint32_t best = 0xFFFFFFFF;
+    for(int i=0; i<CLOCK_CALIBRATE_RUNS; i++)
+    {
+        uint32_t cycles = clock_calibrate_once();
+        if(cycles < best) { best = cycles; }
+    }
+
+    if(ints_enabled) { asm volatile("sti"); }
+
+    // Slower than 1MHz is not a TSC we want to trust.
+    uint32_t khz = best / CLOCK_CALIBRATE_MS;
+    if(khz < 1000) { return; }
+
+    clock_ns_mult = clock_scale(1000000, khz, CLOCK_NS_SHIFT);
+    clock_ms_mult = clock_scale(1, khz, CLOCK_MS_SHIFT);
+    clock_cycles_mult = clock_scale(khz, 1000000, CLOCK_CYCLES_SHIFT);
+    clock_tsc_base = READ_TSC();
+    clock_tsc_khz = khz;
+}
+
+//========================================================================================
+/* Returns the TSC frequency in kHz, or 0 if the clock runs off the PIT. */
+uint32_t clock_get_khz()
+{
+    return(clock_tsc_khz);
+}
+
+//========================================================================================
+/* Returns the cycles since boot. */
+uint64_t clock_get_cycles()
+{
+    return(READ_TSC() - clock_tsc_base);
+}
+
+//========================================================================================
+/* Turns a cycle count into nanoseconds. */
+uint64_t clock_cycles_to_ns(uint64_t cycles)
+{
+    return(clock_mul_shift(cycles, clock_ns_mult, CLOCK_NS_SHIFT));
+}
+
+//========================================================================================
+/* Returns monotonic nanoseconds since boot. */
+uint64_t clock_get_ns()
+{
+    if(!clock_tsc_khz)
+    {
+        return((uint64_t)timer_get_ms() * 1000000);
+    }
+    return(clock_cycles_to_ns(clock_get_cycles()));
+}
+
+//========================================================================================
+/* Returns monotonic milliseconds since boot. Wraps after 49 days. */
+uint32_t clock_get_ms()
+{
+    if(!clock_tsc_khz)
+    {
+        return(timer_get_ms());
+    }
+    return((uint32_t)clock_mul_shift(clock_get_cycles(), clock_ms_mult, CLOCK_MS_SHIFT));
+}
+
+//========================================================================================
+/* Busy waits for at least ns nanoseconds. Works with interrupts disabled. */
+void ndelay(uint32_t ns)
+{
+    if(!clock_tsc_khz)
+    {
+        // No TSC. Round up to whole PIT counts. Each is about 838ns.
+        uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+        asm volatile("cli");
+        uint32_t counts = (ns / 838) + 1;
+        uint32_t start = timer_elapsed();
+        while((timer_elapsed() - start) < counts) { continue; }
+        if(ints_enabled) { asm volatile("sti"); }
+        return;
+    }
+
+    uint64_t cycles = clock_mul_shift(ns, clock_cycles_mult, CLOCK_CYCLES_SHIFT) + 1;
+    uint64_t start = READ_TSC();
+    while((READ_TSC() - start) < cycles)
+    {
+        asm volatile("pause");
+    }
+}
+
+//========================================================================================
+/* Busy waits for at least us microseconds. */
+void udelay(uint32_t us)
+{
+    // Stay in range of ndelay() a millisecond at a time.
+    while(us > 1000)
+    {
+        ndelay(1000000);
+        us -= 1000;
+    }
+    ndelay(us * 1000);
+}
+
+//========================================================================================
+/* Displays the time since boot. */
+void clock_display_uptime()
+{
+    uint32_t ms = clock_get_ms();
+    uint32_t seconds = ms / 1000;
+    ms %= 1000;
+
+    kprintf("up %d:", seconds / 3600);
+    if((seconds / 60) % 60 < 10) { kprintf("0"); }
+    kprintf("%d:", (seconds / 60) % 60);
+    if(seconds % 60 < 10) { kprintf("0"); }
+    kprintf("%d.", seconds % 60);
+    if(ms < 100) { kprintf("0"); }
+    if(ms < 10)  { kprintf("0"); }
+    kprintf("%d\n", ms);
+
+    if(clock_tsc_khz)
+    {
+        kprintf("clocksource tsc, %d.%d MHz\n", clock_tsc_khz / 1000, (clock_tsc_khz % 1000) / 100);
+    }
+    else
+    {
+        kprintf("clocksource pit\n");
+    }
+}
@@ -0,0 +1,244 @@
+#include <kernel.h>
+#include <io.h>
+#include <string.h>
+
+// Defined in link.ld. We only ever want its address.
+extern uint8_t kernel_end[];
+
+// One bit per 4KiB physical frame. 1 = used/reserved, 0 = free.
+static uint32_t* frame_bitmap;
+static uint32_t  frame_bitmap_words;
+
+// Frames covered by the bitmap, frames that were usable, and frames still free.
+static uint32_t frame_count;
+static uint32_t frame_usable;
+static uint32_t frame_available;
+
+// Guards the bitmap and the counters.
+static spinlock_t frame_lock;
+
+// No free frame lives below this bitmap word. Keeps frame_alloc() from rescanning low memory.
+static uint32_t frame_search_hint;
+
+#define FRAME_INDEX(addr)   ((addr) / PAGE_SIZE)
+#define FRAME_IS_USED(f)    (frame_bitmap[(f) / 32] & (1 << ((f) % 32)))
+
+//========================================================================================
+/* Helper: Marks a range of frames as used. */
+static void frame_mark_used(uint32_t first, uint32_t count)
+{
+    for(uint32_t f=first; f<first+count && f<frame_count; f++)
+    {
+        if(!FRAME_IS_USED(f))
+        {
+            frame_bitmap[f / 32] |= (1 << (f % 32));
+            frame_available--;
+        }
+    }
+}
+
+//========================================================================================
+/* Helper: Marks a range of frames as free. */
+static void frame_mark_free(uint32_t first, uint32_t count)
+{
+    for(uint32_t f=first; f<first+count && f<frame_count; f++)
+    {
+        if(FRAME_IS_USED(f))
+        {
+            frame_bitmap[f / 32] &= ~(1 << (f % 32));
+            frame_available++;
+        }
+    }
+
+    if(first / 32 < frame_search_hint)
+    {
+        frame_search_hint = first / 32;
+    }
+}
+
+//========================================================================================
+/*
+ * Builds the frame bitmap from the available memory map.
+ *
+ * The bitmap itself is placed right after the kernel image.
+ * Low memory, the kernel, the bitmap, and the program window are reserved.
+ */
+void frame_init()
+{
+    // Find the top of usable memory. We can only address the first 4GB.
+    uint32_t top = 0;
+    for(size_t i=0; i<mmap_avail_entry_count; i++)
+    {
+        memory_region_t* region = &available_memory_map[i];
+        if(region->base_high != 0) { continue; }
+
+        uint64_t region_end = (uint64_t)region->base_low + \
+            (((uint64_t)region->length_high << 32) | region->length_low);
+        if(region_end > 0xFFFFF000)
+        {
+            region_end = 0xFFFFF000;
+        }
+
+        if((uint32_t)region_end > top)
+        {
+            top = (uint32_t)region_end;
+        }
+    }
+
+    frame_count = FRAME_INDEX(top);
+    frame_bitmap_words = (frame_count + 31) / 32;
+
+    // Put the bitmap on the first page boundary after the kernel.
+    uint32_t bitmap_addr = ((uint32_t)kernel_end + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+    uint32_t bitmap_end  = bitmap_addr + (frame_bitmap_words * 4);
+    if(bitmap_end > USER_IMAGE_BASE)
+    {
+        kprintf("frame bitmap(0x%x - 0x%x) runs into the program window(0x%x)\n", bitmap_addr, bitmap_end, USER_IMAGE_BASE);
+        SYSTEM_HALT();
+    }
+    frame_bitmap = (uint32_t*)bitmap_addr;
+
+    // Start with everything used, and only free what the BIOS says is available.
+    memset(frame_bitmap, 0xff, frame_bitmap_words * 4);
+    frame_available = 0;
+    frame_search_hint = 0;
+    for(size_t i=0; i<mmap_avail_entry_count; i++)
+    {
+        memory_region_t* region = &available_memory_map[i];
+        if(region->base_high != 0) { continue; }
+
+        uint64_t region_end = (uint64_t)region->base_low + \
+            (((uint64_t)region->length_high << 32) | region->length_low);
+        if(region_end > top)
+        {
+            region_end = top;
+        }
+
+        // Only whole frames are usable.
+        uint32_t first = FRAME_INDEX(region->base_low + (PAGE_SIZE - 1));
+        uint32_t last  = FRAME_INDEX((uint32_t)region_end);
+        if(last > first)
+        {
+            frame_mark_free(first, last - first);
+        }
+    }
+    frame_usable = frame_available;
+
+    // Reserve what is already spoken for.
+    frame_mark_used(0, FRAME_INDEX(FRAME_LOW_MEMORY_END));
+    frame_mark_used(FRAME_INDEX(KERNEL_PHYSICAL_BASE), FRAME_INDEX(bitmap_end + (PAGE_SIZE - 1)) - FRAME_INDEX(KERNEL_PHYSICAL_BASE));
+    frame_mark_used(FRAME_INDEX(USER_IMAGE_BASE), FRAME_INDEX(USER_IMAGE_END - USER_IMAGE_BASE));
+    frame_search_hint = 0;
+}
+
+//========================================================================================
+/* Allocates a single frame. Returns its physical address, or 0 if we are out of memory. */
+uint32_t frame_alloc()
+{
+    uint32_t flags = spin_lock_irqsave(&frame_lock);
+
+    for(uint32_t w=frame_search_hint; w<frame_bitmap_words; w++)
+    {
+        // Skip words with no free frames.
+        if(frame_bitmap[w] == 0xFFFFFFFF) { continue; }
+
+        uint32_t f = (w * 32) + __builtin_ctz(~frame_bitmap[w]);
+        if(f >= frame_count) { break; }
+
+        frame_bitmap[w] |= (1 << (f % 32));
+        frame_available--;
+        frame_search_hint = w;
+
+        spin_unlock_irqrestore(&frame_lock, flags);
+        return(f * PAGE_SIZE);
+    }
+
+    spin_unlock_irqrestore(&frame_lock, flags);
+    return(0);
+}
+
+//========================================================================================
+/* Allocates count physically contiguous frames. Returns the first address, or 0. */
+uint32_t frame_alloc_contiguous(uint32_t count)
+{
+    if(count == 0) { return(0); }
+    if(count == 1) { return(frame_alloc()); }
+
+    uint32_t flags = spin_lock_irqsave(&frame_lock);
+
+    // First fit search for a long enough run of free frames.
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    for(uint32_t f=frame_search_hint*32; f<frame_count; f++)
+    {
+        // Skip a whole word at a time when it is full.
+        if((f % 32) == 0 && frame_bitmap[f / 32] == 0xFFFFFFFF)
+        {
+            run_length = 0;
+            f += 31;
+            continue;
+        }
+
+        if(FRAME_IS_USED(f))
+        {
+            run_length = 0;
+            continue;
+        }
+
+        if(run_length == 0) { run_start = f; }
+        run_length++;
+
+        if(run_length == count)
+        {
+            frame_mark_used(run_start, count);
+            spin_unlock_irqrestore(&frame_lock, flags);
+            return(run_start * PAGE_SIZE);
+        }
+    }
+
+    spin_unlock_irqrestore(&frame_lock, flags);
+    return(0);
+}
+
+//========================================================================================
+/* Gives a single frame back. */
+void frame_free(uint32_t addr)
+{
+    frame_free_contiguous(addr, 1);
+}
+
+//========================================================================================
+/* Gives count contiguous frames back. */
+void frame_free_contiguous(uint32_t addr, uint32_t count)
+{
+    // Never let anyone free low memory or the kernel by mistake.
+    if(addr < FRAME_LOW_MEMORY_END || (addr % PAGE_SIZE) != 0) { return; }
+
+    uint32_t flags = spin_lock_irqsave(&frame_lock);
+    frame_mark_free(FRAME_INDEX(addr), count);
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+//========================================================================================
+/* Returns the address just past the last frame we track. */
+uint32_t frame_memory_top()
+{
+    return(frame_count * PAGE_SIZE);
+}
+
+//========================================================================================
+/* Returns the number of free frames. */
+uint32_t frame_free_count()
+{
+    return(frame_available);
+}
+
+//========================================================================================
+/* Displays the page frame statistics. */
+void frame_display_stats()
+{
+    uint32_t used = frame_usable - frame_available;
+    kprintf("frames   usable      free      used      bitmap\n");
+    kprintf("         %d       %d       %d       %xh\n", frame_usable, frame_available, used, (uint32_t)frame_bitmap);
+    kprintf("         %dK      %dK      %dK\n", frame_usable * 4, frame_available * 4, used * 4);
+}
@@ -5,34 +5,102 @@
 struct HEAP_info system_heap;
 static uint32_t current_block_address; // This is our high-water mark
 
+// Segregated free lists. One list per size class, plus a bitmap of non-empty lists.
+static free_block_t* heap_bins[HEAP_BIN_COUNT];
+static uint32_t heap_bin_map;
+
 // Define our alignment boundary
 #define HEAP_ALIGNMENT 8
 
+// The header and footer (boundary tags) around every payload.
+#define HEAP_TAG_SIZE (sizeof(malloc_t) * 2)
+
+// How many blocks we are willing to look at in a request's own bin before moving up.
+#define HEAP_BIN_SCAN_LIMIT 4
+
+// malloc() and free() are never called from interrupt handlers, so a sleeping lock will do.
+static mutex_t heap_mutex;
+
 //========================================================================================
-/* Initialize the heap at 0x100000 bytes above the kernel and 0x100000 bytes in length. */
-void heap_init()
+/* Helper: Backs the heap with frames until it reaches new_end. Returns 0 on success. */
+static int heap_grow(uint32_t new_end)
 {
-    // For now we just allocate starting 1MB after the kernel offset.
-    // This should always point to main memory(largest mmap region).
-    // The system will halt in mmap.c if kernel_base != main_memory_base.
-    // Eventually we will remap there and get more sophisticated with this.
-    uint32_t base_addr = KERNEL_PHYSICAL_BASE + 0x100000;
-    size_t length = 0x100000;
+    if(new_end > KERNEL_HEAP_BASE + KERNEL_HEAP_MAX_SIZE)
+    {
+        return(-1);
+    }
 
-    // Ensure the heap base itself is aligned to our 8-byte boundary.
-    if (base_addr % HEAP_ALIGNMENT != 0) {
-        base_addr = (base_addr + (HEAP_ALIGNMENT - 1)) & ~(HEAP_ALIGNMENT - 1);
+    while(system_heap.end < new_end)
+    {
+        uint32_t frame = frame_alloc();
+        if(!frame)
+        {
+            return(-1);
+        }
+
+        if(paging_map_page(system_heap.end, frame, PTE_PRESENT | PTE_READ_WRITE | paging_global_flag) != 0)
+        {
+            frame_free(frame);
+            return(-1);
+        }
+
+        // Fresh heap memory always starts out as 0's.
+        memset((void*)system_heap.end, 0, PAGE_SIZE);
+        system_heap.end  += PAGE_SIZE;
+        system_heap.size += PAGE_SIZE;
     }
+    return(0);
+}
+
+//========================================================================================
+/* Helper: Gives the whole free pages above the high-water mark back to the frame allocator. */
+static void heap_trim()
+{
+    // Never shrink below the initial size, and keep one spare page to avoid thrashing.
+    uint32_t keep = (current_block_address + PAGE_SIZE + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+    if(keep < system_heap.base + KERNEL_HEAP_INITIAL)
+    {
+        keep = system_heap.base + KERNEL_HEAP_INITIAL;
+    }
+
+    while(system_heap.end > keep)
+    {
+        uint32_t frame = paging_unmap_page(system_heap.end - PAGE_SIZE);
+        if(frame)
+        {
+            frame_free(frame);
+        }
+        system_heap.end  -= PAGE_SIZE;
+        system_heap.size -= PAGE_SIZE;
+    }
+}
+
+//========================================================================================
+/* Initialize the heap at KERNEL_HEAP_BASE with KERNEL_HEAP_INITIAL bytes mapped. */
+void heap_init()
+{
+    // The heap has its own virtual window. It is backed by page frames as it grows,
+    // so it can use any installed memory and not just what follows the kernel.
+    uint32_t base_addr = KERNEL_HEAP_BASE;
 
     // Fill in our HEAP_info structure for user to reference.
     system_heap.base = base_addr;
-    system_heap.size = length;
+    system_heap.size = 0;
     system_heap.used = 0;
-    system_heap.end  = base_addr + length;
-
-    // Initialize the heap with all 0's.
-    memset((uint32_t*)system_heap.base, 0, system_heap.size);
+    system_heap.end  = base_addr;
     current_block_address = system_heap.base;
+    mutex_init(&heap_mutex, "heap");
+
+    // Map (and zero) the initial heap.
+    if(heap_grow(base_addr + KERNEL_HEAP_INITIAL) != 0)
+    {
+        kprintf("Unable to map the initial heap!\n");
+        SYSTEM_HALT();
+    }
+
+    // All of the free lists start out empty.
+    memset(heap_bins, 0, sizeof(heap_bins));
+    heap_bin_map = 0;
 }
 
 //========================================================================================
@@ -48,18 +116,107 @@ void print_heap_info()
 }
 
 //========================================================================================
-/* First Fit Memory Heap Allocator. */
+/* Helper: Returns the size class (bin) for a payload size. */
+static uint32_t heap_bin_index(size_t sz)
+{
+    // Payloads are at least 8 bytes, so bin 0 starts at 2^3.
+    uint32_t bin = (31 - __builtin_clz(sz)) - 3;
+    if(bin >= HEAP_BIN_COUNT)
+    {
+        bin = HEAP_BIN_COUNT - 1;
+    }
+    return(bin);
+}
+
+//========================================================================================
+/* Helper: Writes the header and the footer (boundary tag) of a block. */
+static void heap_set_tags(malloc_t* alloc, size_t sz, uint8_t reserved)
+{
+    malloc_t* footer = (malloc_t*)((uint32_t)alloc + sizeof(malloc_t) + sz);
+
+    alloc->size = sz;
+    alloc->reserved = reserved;
+    footer->size = sz;
+    footer->reserved = reserved;
+}
+
+//========================================================================================
+/* Helper: Pushes a free block onto the head of its bin. */
+static void heap_bin_insert(malloc_t* alloc)
+{
+    uint32_t bin = heap_bin_index(alloc->size);
+    free_block_t* fb = (free_block_t*)((uint32_t)alloc + sizeof(malloc_t));
+
+    fb->prev = NULL;
+    fb->next = heap_bins[bin];
+    if(fb->next)
+    {
+        fb->next->prev = fb;
+    }
+    heap_bins[bin] = fb;
+    heap_bin_map |= (1 << bin);
+}
+
+//========================================================================================
+/* Helper: Unlinks a free block from its bin. */
+static void heap_bin_remove(malloc_t* alloc)
+{
+    uint32_t bin = heap_bin_index(alloc->size);
+    free_block_t* fb = (free_block_t*)((uint32_t)alloc + sizeof(malloc_t));
+
+    if(fb->prev) { fb->prev->next = fb->next; }
+    else         { heap_bins[bin] = fb->next; }
+    if(fb->next) { fb->next->prev = fb->prev; }
+
+    // Was this the last block in the bin?
+    if(!heap_bins[bin])
+    {
+        heap_bin_map &= ~(1 << bin);
+    }
+
+    fb->next = NULL;
+    fb->prev = NULL;
+}
+
+//========================================================================================
+/* Helper: Finds a free block with at least sz bytes of payload, or NULL. */
+static malloc_t* heap_find_free(size_t sz)
+{
+    uint32_t bin = heap_bin_index(sz);
+
+    // A block in our own bin may or may not be big enough, so only look at a few.
+    free_block_t* fb = heap_bins[bin];
+    for(int i=0; fb && i<HEAP_BIN_SCAN_LIMIT; i++)
+    {
+        malloc_t* alloc = (malloc_t*)((uint32_t)fb - sizeof(malloc_t));
+        if(alloc->size >= sz)
+        {
+            return(alloc);
+        }
+        fb = fb->next;
+    }
+
+    // Any block in a bigger bin is big enough. Take the first non-empty one.
+    uint32_t larger = heap_bin_map & ~((2 << bin) - 1);
+    if(larger)
+    {
+        fb = heap_bins[__builtin_ctz(larger)];
+        return((malloc_t*)((uint32_t)fb - sizeof(malloc_t)));
+    }
+
+    return(NULL);
+}
+
+//========================================================================================
+/* Segregated Fit Memory Heap Allocator. */
 void* malloc(size_t sz)
 {
-    if(sz == 0) 
+    if(sz == 0)
     {
-        return((void*)0); 
+        return((void*)0);
     }
 
-    // The EFLAGS register contains the "Interrupt Flag" (IF) bit (Bit 9). 
-    // If that bit is 1, interrupts are on.
-    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
-    asm volatile("cli");    // Disable interrupts to be safe.
+    mutex_lock(&heap_mutex);
 
     // Align the requested size UP to the nearest 8 bytes.
     // This ensures that the next block header will also be aligned.
@@ -67,73 +224,61 @@ void* malloc(size_t sz)
         sz = (sz + (HEAP_ALIGNMENT - 1)) & ~(HEAP_ALIGNMENT - 1);
     }
 
-    // Calculate the total size needed for the new block (header + data)
-    size_t total_needed = sz + sizeof(malloc_t);
+    // Calculate the total size needed for the new block (header + data + footer)
+    size_t total_needed = sz + HEAP_TAG_SIZE;
 
-    // Iterate from the base of the heap up to the high-water mark
-    uint32_t block_iter = system_heap.base;
-    while(block_iter < current_block_address)
+    // Check the free lists for a block that is big enough.
+    malloc_t* alloc = heap_find_free(sz);
+    if(alloc)
     {
-        // Create an allocation at the current block iteration. 
-        malloc_t* alloc = (malloc_t*)block_iter;
+        heap_bin_remove(alloc);
+
+        // Found a suitable block. Can we split it? (header[8] + footer[8] + 16) = 32 bytes.
+        size_t current_block_total_size = alloc->size + HEAP_TAG_SIZE;
+        size_t remaining_size = current_block_total_size - total_needed;
+        if(remaining_size >= MIN_BLOCK_SPLIT)
+        {
+            /* Split the block */
 
-        // Get the size of the current block iteration. Should be 0 if not previously allocated.
-        size_t current_block_total_size = alloc->size + sizeof(malloc_t);
+            // Resize the block we're about to use
+            heap_set_tags(alloc, sz, 1);
+            system_heap.used += total_needed;
 
-        // Check if this block is free && big enough for the request
-        if(alloc->reserved == 0 && alloc->size >= sz)
+            // Create a new free block in the remaining space and file it in its bin.
+            malloc_t* new_free_alloc = (malloc_t*)((uint32_t)alloc + total_needed);
+            heap_set_tags(new_free_alloc, remaining_size - HEAP_TAG_SIZE, 0);
+            heap_bin_insert(new_free_alloc);
+        }
+        else
         {
-            // Found a suitable block. Can we split it? (sizeof(malloc_t)[8] + 16) = 24 bytes.
-            size_t remaining_size = current_block_total_size - total_needed;
-            if(remaining_size >= (sizeof(malloc_t) + 16))
-            {
-                /* Split the block */
-
-                // Resize the block we're about to use
-                alloc->reserved = 1;
-                alloc->size = sz; // Set to the *new* requested size
-                system_heap.used += total_needed;
-
-                // Create a new free block header in the remaining space
-                uint32_t new_free_block_addr = block_iter + total_needed;
-                malloc_t* new_free_alloc = (malloc_t*)new_free_block_addr;
-                new_free_alloc->reserved = 0;
-                new_free_alloc->size = remaining_size - sizeof(malloc_t);
-            }
-            else 
-            {
-                // Use the whole block (not enough space to split)
-                alloc->reserved = 1;
-                system_heap.used += current_block_total_size;
-            }
-
-            if(ints_enabled) { asm volatile("sti"); }
-            return((void*)block_iter + sizeof(malloc_t));
+            // Use the whole block (not enough space to split)
+            heap_set_tags(alloc, alloc->size, 1);
+            system_heap.used += current_block_total_size;
         }
-        
-        // Not a match, move to the next block header
-        block_iter += current_block_total_size;
+
+        mutex_unlock(&heap_mutex);
+        return((void*)alloc + sizeof(malloc_t));
     }
 
-    /* If we're here, no suitable free block was found before the high-water mark. */
-    
-    // Out-of-Memory Check
-    if((block_iter + total_needed) > system_heap.end)
+    /* If we're here, no suitable free block was found in the free lists. */
+
+    // Grow the heap if the new block does not fit. Out-of-Memory if we can't.
+    if((current_block_address + total_needed) > system_heap.end \
+    && heap_grow(current_block_address + total_needed) != 0)
     {
-        if(ints_enabled) { asm volatile("sti"); }
+        mutex_unlock(&heap_mutex);
         return ((void*)0);
     }
 
     // Create the new block at the high-water mark
-    malloc_t* new_alloc = (malloc_t*)block_iter;
-    new_alloc->reserved = 1;
-    new_alloc->size = sz;
+    alloc = (malloc_t*)current_block_address;
+    heap_set_tags(alloc, sz, 1);
 
     system_heap.used += total_needed;
-    current_block_address = block_iter + total_needed; // Bump the high-water mark
+    current_block_address += total_needed; // Bump the high-water mark
 
-    if(ints_enabled) { asm volatile("sti"); }
-    return((void*)block_iter + sizeof(malloc_t));
+    mutex_unlock(&heap_mutex);
+    return((void*)alloc + sizeof(malloc_t));
 }
 
 //========================================================================================
@@ -145,80 +290,145 @@ void free(void* b)
 
     malloc_t* alloc = (malloc_t*)(b - sizeof(malloc_t));
 
+    mutex_lock(&heap_mutex);
+
     // Check for double-free
-    if(alloc->reserved == 0) 
+    if(alloc->reserved == 0)
     {
+        mutex_unlock(&heap_mutex);
         return; // This block is already free
     }
 
-    // The EFLAGS register contains the Interrupt Flag (IF) bit (Bit 9). 
-    // If that bit is 1, interrupts are on.
-    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
-    asm volatile("cli");    // Disable interrupts to be safe.
-
     // Mark as free and update heap usage
-    alloc->reserved = 0;
-    system_heap.used -= (alloc->size + sizeof(malloc_t));
+    size_t sz = alloc->size;
+    system_heap.used -= (sz + HEAP_TAG_SIZE);
 
     // Clear the memory.
-    memset(b, 0, alloc->size);
-    
-    // Forward Coalesce. Check the block after this one
-    uint32_t next_block_addr = (uint32_t)alloc + sizeof(malloc_t) + alloc->size;
+    memset(b, 0, sz);
 
-    // Do some checks to make sure we don't go out of bounds.
-    if(current_block_address < system_heap.end)
+    // Forward Coalesce. The block after this one starts right after our footer.
+    uint32_t next_block_addr = (uint32_t)alloc + HEAP_TAG_SIZE + sz;
+    if(next_block_addr < current_block_address)
     {
-        if(next_block_addr < current_block_address)
+        malloc_t* next_alloc = (malloc_t*)next_block_addr;
+        if(next_alloc->reserved == 0)
         {
-            malloc_t* next_alloc = (malloc_t*)next_block_addr;
-
-            // Prevents reading 4 bytes off the edge of the heap.
-            if((uint32_t)next_alloc + sizeof(malloc_t) <= system_heap.end)
-            {
-                if(next_alloc->reserved == 0)
-                {
-                    // The next block is free, so merge it into the current one
-                    alloc->size += sizeof(malloc_t) + next_alloc->size;
-
-                    // Clear the old header
-                    memset(next_alloc, 0, sizeof(malloc_t));
-                }
-            }
+            // The next block is free, so pull it out of its bin and merge it into the current one
+            heap_bin_remove(next_alloc);
+            sz += HEAP_TAG_SIZE + next_alloc->size;
+
+            // Clear our old footer and its old header. They are payload now.
+            memset((void*)next_block_addr - sizeof(malloc_t), 0, HEAP_TAG_SIZE);
         }
     }
 
-    // Backward Coalesce. Find the block before this one.
-    uint32_t block_iter = system_heap.base;
-    malloc_t* prev_alloc = NULL;
-    
-    while(block_iter < (uint32_t)alloc)
+    // Backward Coalesce. The footer of the block before this one sits right before our header.
+    if((uint32_t)alloc > system_heap.base)
     {
-        prev_alloc = (malloc_t*)block_iter;
-        block_iter += prev_alloc->size + sizeof(malloc_t);
-    }
-    
-    // prev_alloc now points to the block right before alloc
-    if(prev_alloc != NULL && prev_alloc->reserved == 0)
-    {
-        // The previous block is free, so merge the current block into it
-        prev_alloc->size += sizeof(malloc_t) + alloc->size;
+        malloc_t* prev_footer = (malloc_t*)((uint32_t)alloc - sizeof(malloc_t));
+        if(prev_footer->reserved == 0)
+        {
+            // The previous block is free, so merge the current block into it
+            malloc_t* prev_alloc = (malloc_t*)((uint32_t)alloc - HEAP_TAG_SIZE - prev_footer->size);
+            heap_bin_remove(prev_alloc);
+            sz += HEAP_TAG_SIZE + prev_alloc->size;
 
-        // Clear the old header
-        memset(alloc, 0, sizeof(malloc_t));
-        
-        // The "current" block for the high-water-mark check is now 'prev_alloc'
-        alloc = prev_alloc;
+            // Clear its old footer and our old header.
+            memset(prev_footer, 0, HEAP_TAG_SIZE);
+
+            // The "current" block for the high-water-mark check is now 'prev_alloc'
+            alloc = prev_alloc;
+        }
     }
 
     // Shrink High-Water Mark.
     // If we just freed the last block (or a merge created a new last block),
-    // we can "shrink" the heap's high-water mark.
-    if(((uint32_t)alloc + sizeof(malloc_t) + alloc->size) == current_block_address)
+    // we can "shrink" the heap's high-water mark instead of keeping it on a free list.
+    if(((uint32_t)alloc + HEAP_TAG_SIZE + sz) == current_block_address)
     {
+        memset(alloc, 0, sizeof(malloc_t));
+        memset((void*)alloc + sizeof(malloc_t) + sz, 0, sizeof(malloc_t));
         current_block_address = (uint32_t)alloc;
+        heap_trim();
+    }
+    else
+    {
+        heap_set_tags(alloc, sz, 0);
+        heap_bin_insert(alloc);
     }
 
-    if(ints_enabled) { asm volatile("sti"); }
+    mutex_unlock(&heap_mutex);
     return;
-}
\ No newline at end of file
+}
+
+//========================================================================================
+/*
+ * Measures malloc() and free() latency in cycles.
+ * For comparison it also times a walk over every block up to the high-water mark.
+ * That walk is what the old first fit allocator did on each miss and on every free().
+ */
+#define HEAP_BENCH_BLOCKS 256
+void heap_benchmark()
+{
+    static void* blocks[HEAP_BENCH_BLOCKS];
+    uint32_t seed = 0x1234;
+    uint32_t malloc_cycles = 0, malloc_count = 0;
+    uint32_t free_cycles = 0, free_count = 0;
+    uint32_t start;
+
+    memset(blocks, 0, sizeof(blocks));
+
+    // Fill the heap with blocks of mixed sizes, then punch holes in it.
+    for(int pass=0; pass<2; pass++)
+    {
+        for(int i=0; i<HEAP_BENCH_BLOCKS; i++)
+        {
+            if(blocks[i]) { continue; }
+
+            seed = (seed * 1103515245) + 12345;
+            size_t sz = 16 + ((seed >> 16) % 1024);
+
+            start = (uint32_t)READ_TSC();
+            blocks[i] = malloc(sz);
+            malloc_cycles += (uint32_t)READ_TSC() - start;
+            malloc_count++;
+        }
+
+        for(int i=pass; i<HEAP_BENCH_BLOCKS; i+=2)
+        {
+            start = (uint32_t)READ_TSC();
+            free(blocks[i]);
+            free_cycles += (uint32_t)READ_TSC() - start;
+            free_count++;
+            blocks[i] = NULL;
+        }
+    }
+
+    // Time one full walk of the heap, like the old allocator did.
+    // Other tasks may be splitting or merging blocks, so hold the heap still.
+    uint32_t block_count = 0;
+    mutex_lock(&heap_mutex);
+    start = (uint32_t)READ_TSC();
+    for(uint32_t block_iter = system_heap.base; block_iter < current_block_address; block_count++)
+    {
+        block_iter += ((malloc_t*)block_iter)->size + HEAP_TAG_SIZE;
+    }
+    uint32_t walk_cycles = (uint32_t)READ_TSC() - start;
+    mutex_unlock(&heap_mutex);
+
+    // Give everything back.
+    for(int i=0; i<HEAP_BENCH_BLOCKS; i++)
+    {
+        if(!blocks[i]) { continue; }
+
+        start = (uint32_t)READ_TSC();
+        free(blocks[i]);
+        free_cycles += (uint32_t)READ_TSC() - start;
+        free_count++;
+        blocks[i] = NULL;
+    }
+
+    kprintf("segregated malloc: %d cycles avg (%d calls)\n", malloc_cycles / malloc_count, malloc_count);
+    kprintf("segregated free:   %d cycles avg (%d calls)\n", free_cycles / free_count, free_count);
+    kprintf("first fit walk:    %d cycles for %d blocks\n", walk_cycles, block_count);
+}
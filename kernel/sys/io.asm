@@ -13,6 +13,10 @@ global OUTW
 global INW
 global OUTL
 global INL
+global INSW
+global OUTSW
+global INSL
+global OUTSL
 
 ;=============================================================================================
 
@@ -53,4 +57,48 @@ OUTL:
 INL:
     mov edx, [esp + 4]  ; Get port from stack
     in  eax,  dx        ; Read from the I/O port (already uses full eax)
-    ret
\ No newline at end of file
+    ret
+
+;=============================================================================================
+; Block transfers, for data ports like the one of an ATA drive. (port, buffer, count)
+; Count is in words or dwords. esi and edi belong to the caller.
+
+INSW:
+    push edi
+    mov  edx, [esp + 8]     ; Get port from stack
+    mov  edi, [esp + 12]    ; Get buffer from stack
+    mov  ecx, [esp + 16]    ; Get count from stack
+    cld
+    rep  insw               ; Read ecx words from the I/O port into the buffer
+    pop  edi
+    ret
+
+OUTSW:
+    push esi
+    mov  edx, [esp + 8]     ; Get port from stack
+    mov  esi, [esp + 12]    ; Get buffer from stack
+    mov  ecx, [esp + 16]    ; Get count from stack
+    cld
+    rep  outsw              ; Write ecx words from the buffer to the I/O port
+    pop  esi
+    ret
+
+INSL:
+    push edi
+    mov  edx, [esp + 8]     ; Get port from stack
+    mov  edi, [esp + 12]    ; Get buffer from stack
+    mov  ecx, [esp + 16]    ; Get count from stack
+    cld
+    rep  insd               ; Read ecx dwords from the I/O port into the buffer
+    pop  edi
+    ret
+
+OUTSL:
+    push esi
+    mov  edx, [esp + 8]     ; Get port from stack
+    mov  esi, [esp + 12]    ; Get buffer from stack
+    mov  ecx, [esp + 16]    ; Get count from stack
+    cld
+    rep  outsd              ; Write ecx dwords from the buffer to the I/O port
+    pop  esi
+    ret
@@ -1,4 +1,5 @@
 #include <kernel.h>
+#include <io.h>
 #include <string.h>
 
 /*
@@ -9,48 +10,658 @@
  */
 
 // This holds 1024 Page Directory Entries (PDEs).
-// Each entry points to a Page Table.
+// Each entry points to a Page Table, or maps a whole 4MB page by itself.
 static uint32_t page_directory[1024] __attribute__((aligned(PAGE_SIZE)));
 
-// We are just going to identity map everything to keep things simple.
-#define PTI_COUNT 32
-static uint32_t page_table_ident[PTI_COUNT][1024] __attribute__((aligned(PAGE_SIZE)));
+// The first 4MB keeps a real page table so it can be controlled one 4KiB page at a time.
+// Everything above it is identity mapped with 4MB pages when the cpu has PSE.
+static uint32_t page_table_low[1024] __attribute__((aligned(PAGE_SIZE)));
+
+// CPUID.01h:EDX feature bits and CR4 bits.
+#define CPUID_FEATURE_PSE   (1 << 3)
+#define CPUID_FEATURE_PGE   (1 << 13)
+#define CR4_PSE             (1 << 4)
+#define CR4_PGE             (1 << 7)
 
 // The global pointer to the physical address of the page directory.
 // This is what kernel.asm will use to load CR3.
 uint32_t* page_dir_phys_addr;
 
-/* Initializes the paging system. */
+// Everything below this is identity mapped. Page tables we allocate later must live here.
+uint32_t paging_identity_end;
+
+// 1 if the identity map above 4MB is made of 4MB pages.
+uint8_t paging_large_pages;
+
+// PTE_GLOBAL if kernel mappings can be made global, otherwise 0.
+uint32_t paging_global_flag;
+
+// Every task address space, and the one each cpu has loaded in CR3. NULL means the kernel's own.
+static address_space_t* address_space_list;
+static address_space_t* current_space[SMP_MAX_CPUS];
+
+// Guards the page tables and the address space list against other cpus.
+static spinlock_t paging_lock;
+
+// A page of zeros. Program window pages that are read before they are written all share it.
+static uint32_t paging_zero_frame;
+
+// How often the page fault handler has filled in a page.
+static uint32_t paging_zero_faults;
+static uint32_t paging_cow_faults;
+
+//========================================================================================
+/* Helper: Returns the CPUID.01h feature flags in EDX. */
+static uint32_t paging_cpu_features()
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return(edx);
+}
+
+//========================================================================================
+/* Initializes the paging system. Must be called with paging still disabled. */
 void paging_init()
 {
     // Clear all page structures to zero.
     // This ensures all "Present" bits are 0 by default.
     memset(page_directory, 0, sizeof(page_directory));
-    memset(&page_table_ident, 0, PTI_COUNT*1024);
+    memset(page_table_low, 0, sizeof(page_table_low));
 
-    uint32_t physical_addr = 0;
-    for(int n=0; n<PTI_COUNT; n++)
+    // Identity map all installed memory, rounded up to 4MB. It has to stay clear of the heap window.
+    paging_identity_end = (frame_memory_top() + 0x3FFFFF) & ~0x3FFFFF;
+    if(paging_identity_end == 0 || paging_identity_end > KERNEL_HEAP_BASE)
     {
-        // Loop through the 1024 page tables in the directory.
-        for(size_t i=0; i<1024; i++)
+        paging_identity_end = KERNEL_HEAP_BASE;
+    }
+
+    // Use 4MB pages for the identity map if we can. One TLB entry then covers what used to take 1024.
+    // Kernel mappings are made global if we can, so they stay in the TLB when CR3 changes.
+    uint32_t features = paging_cpu_features();
+    uint32_t cr4_bits = 0;
+    paging_large_pages = (features & CPUID_FEATURE_PSE) ? 1 : 0;
+    paging_global_flag = (features & CPUID_FEATURE_PGE) ? PTE_GLOBAL : 0;
+    if(paging_large_pages) { cr4_bits |= CR4_PSE; }
+    if(paging_global_flag) { cr4_bits |= CR4_PGE; }
+    asm volatile("mov %%cr4, %%eax\n\t"
+                 "or  %0, %%eax\n\t"
+                 "mov %%eax, %%cr4" :: "r"(cr4_bits) : "eax");
+
+    // The first 4MB. Low memory and the kernel are global.
+    // The program window is left unmapped here. Each task address space fills in its own.
+    for(size_t i=0; i<1024; i++)
+    {
+        uint32_t addr = i * PAGE_SIZE;
+        if(addr >= USER_IMAGE_BASE && addr < USER_IMAGE_END)
         {
-            page_table_ident[n][i] = (physical_addr + (i * PAGE_SIZE)) | PTE_PRESENT | PTE_READ_WRITE;
+            continue;
         }
+        page_table_low[i] = addr | PTE_PRESENT | PTE_READ_WRITE | paging_global_flag;
+    }
+    page_directory[0] = (uint32_t)&page_table_low | PDE_PRESENT | PDE_READ_WRITE;
 
-        // Skip to next 4MB.
-        physical_addr += 0x400000;    
+    for(uint32_t n=1; n<(paging_identity_end >> 22); n++)
+    {
+        uint32_t physical_addr = n * 0x400000;
+        if(paging_large_pages)
+        {
+            page_directory[n] = physical_addr | PDE_PRESENT | PDE_READ_WRITE | PDE_4MB_PAGE | paging_global_flag;
+            continue;
+        }
+
+        // No PSE. Fall back to 4KiB page tables taken from the frame allocator.
+        // Paging is still off, so we can write to the frame directly.
+        uint32_t* table = (uint32_t*)frame_alloc();
+        if(!table)
+        {
+            paging_identity_end = physical_addr;
+            break;
+        }
+        for(size_t i=0; i<1024; i++)
+        {
+            table[i] = (physical_addr + (i * PAGE_SIZE)) | PTE_PRESENT | PTE_READ_WRITE | paging_global_flag;
+        }
+        page_directory[n] = (uint32_t)table | PDE_PRESENT | PDE_READ_WRITE;
     }
 
-    // Link the Page Directory to the Page Tables.
-    // Get the physical addresses of our static page tables.
-    // And then map the table.
-    uint32_t phys_addr[PTI_COUNT];
-    for(int n=0; n<PTI_COUNT; n++)
+    // The shared zero page. Paging is still off, so we can clear it directly.
+    paging_zero_frame = frame_alloc();
+    if(paging_zero_frame)
     {
-        phys_addr[n] = (uint32_t)&page_table_ident[n];
-        page_directory[n] = phys_addr[n] | PDE_PRESENT | PDE_READ_WRITE;
+        memset((void*)paging_zero_frame, 0, PAGE_SIZE);
     }
+    paging_zero_faults = 0;
+    paging_cow_faults = 0;
 
     // Store the physical address of the Page Directory
     page_dir_phys_addr = (uint32_t*)&page_directory;
-}
\ No newline at end of file
+    address_space_list = NULL;
+    memset(current_space, 0, sizeof(current_space));
+}
+
+//========================================================================================
+/*
+ * Throws away every cached translation.
+ * Reloading CR3 keeps global pages, so with PGE we toggle CR4.PGE instead.
+ */
+void paging_flush_tlb()
+{
+    if(paging_global_flag)
+    {
+        asm volatile("mov %%cr4, %%eax\n\t"
+                     "xor %0, %%eax\n\t"
+                     "mov %%eax, %%cr4\n\t"
+                     "xor %0, %%eax\n\t"
+                     "mov %%eax, %%cr4" :: "i"(CR4_PGE) : "eax", "memory");
+        return;
+    }
+
+    asm volatile("mov %%cr3, %%eax\n\t"
+                 "mov %%eax, %%cr3" ::: "eax", "memory");
+}
+
+//========================================================================================
+/* Drops the cached translation of a single page, global or not. */
+void paging_invalidate_page(uint32_t virt)
+{
+    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+//========================================================================================
+/* Helper: Returns a pointer to the PTE for virt, or NULL if it has no page table. */
+static uint32_t* paging_get_pte(uint32_t virt)
+{
+    uint32_t pde = page_directory[virt >> 22];
+    if(!(pde & PDE_PRESENT) || (pde & PDE_4MB_PAGE))
+    {
+        return(NULL);
+    }
+
+    uint32_t* page_table = (uint32_t*)(pde & 0xFFFFF000);
+    return(&page_table[(virt >> 12) & 0x3FF]);
+}
+
+//========================================================================================
+/* Helper: Returns a zeroed frame for a page table or directory, or 0. */
+static uint32_t paging_alloc_table()
+{
+    // We reach page tables through the identity map, so they must come from there.
+    uint32_t table = frame_alloc();
+    if(table == 0 || table >= paging_identity_end)
+    {
+        if(table) { frame_free(table); }
+        return(0);
+    }
+    memset((void*)table, 0, PAGE_SIZE);
+    return(table);
+}
+
+//========================================================================================
+/*
+ * Helper: Fills a fresh frame from the shared frame it replaces.
+ * Shared frames belong to whoever shared them, so the old frame is never freed here.
+ */
+static void paging_copy_shared(uint32_t shared, uint32_t frame)
+{
+    // Frames from paging_alloc_table() are already zero.
+    if(shared != paging_zero_frame)
+    {
+        memcpy((void*)shared, (void*)frame, PAGE_SIZE);
+    }
+}
+
+//========================================================================================
+/*
+ * Maps the 4KiB page at virt to the frame at phys with the given PTE flags.
+ * A page table is taken from the frame allocator if the 4MB region has none yet.
+ * Returns 0 on success, -1 if no page table could be allocated.
+ * Remapping a page that is mapped already needs interrupts on, for the other cpus' TLBs.
+ */
+int paging_map_page(uint32_t virt, uint32_t phys, uint32_t pte_flags)
+{
+    uint32_t pd_index = virt >> 22;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+
+    // A 4MB page can't be mapped over one 4KiB page at a time.
+    if(page_directory[pd_index] & PDE_4MB_PAGE) { return(-1); }
+
+    // The program window belongs to the task address spaces.
+    if(virt >= USER_IMAGE_BASE && virt < USER_IMAGE_END) { return(-1); }
+
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+
+    if(!(page_directory[pd_index] & PDE_PRESENT))
+    {
+        uint32_t table = paging_alloc_table();
+        if(!table)
+        {
+            spin_unlock_irqrestore(&paging_lock, flags);
+            return(-1);
+        }
+        page_directory[pd_index] = table | PDE_PRESENT | PDE_READ_WRITE;
+
+        // Every address space shares the kernel's page tables. Give them the new one too.
+        for(address_space_t* space = address_space_list; space; space = space->next)
+        {
+            space->page_dir[pd_index] = page_directory[pd_index];
+        }
+    }
+
+    uint32_t* page_table = (uint32_t*)(page_directory[pd_index] & 0xFFFFF000);
+    uint32_t old = page_table[pt_index];
+    page_table[pt_index] = (phys & 0xFFFFF000) | (pte_flags & 0xFFF) | PTE_PRESENT;
+    paging_invalidate_page(virt);
+
+    spin_unlock_irqrestore(&paging_lock, flags);
+
+    // Other cpus may still have the old translation.
+    if(old & PTE_PRESENT) { smp_tlb_shootdown(virt); }
+    return(0);
+}
+
+//========================================================================================
+/* Removes the mapping of the 4KiB page at virt. Returns the frame it was mapped to, or 0. Call with interrupts on. */
+uint32_t paging_unmap_page(uint32_t virt)
+{
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+
+    uint32_t* pte = paging_get_pte(virt);
+    uint32_t phys = 0;
+    if(pte && (*pte & PTE_PRESENT))
+    {
+        phys = *pte & 0xFFFFF000;
+        *pte = 0;
+        paging_invalidate_page(virt);
+    }
+
+    spin_unlock_irqrestore(&paging_lock, flags);
+
+    if(phys) { smp_tlb_shootdown(virt); }
+    return(phys);
+}
+
+//========================================================================================
+/* Changes the PTE flags of a mapped 4KiB page, keeping its frame. Returns 0 on success. Call with interrupts on. */
+int paging_protect_page(uint32_t virt, uint32_t pte_flags)
+{
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+
+    uint32_t* pte = paging_get_pte(virt);
+    if(!pte || !(*pte & PTE_PRESENT))
+    {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        return(-1);
+    }
+
+    *pte = (*pte & 0xFFFFF000) | (pte_flags & 0xFFF) | PTE_PRESENT;
+    paging_invalidate_page(virt);
+
+    spin_unlock_irqrestore(&paging_lock, flags);
+
+    smp_tlb_shootdown(virt);
+    return(0);
+}
+
+//========================================================================================
+/* Translates a virtual address to its physical address. Returns 0 if it is not mapped. */
+uint32_t paging_get_physical(uint32_t virt)
+{
+    uint32_t pde = page_directory[virt >> 22];
+    if(!(pde & PDE_PRESENT))
+    {
+        return(0);
+    }
+
+    // A 4MB page maps the whole region itself.
+    if(pde & PDE_4MB_PAGE)
+    {
+        return((pde & 0xFFC00000) | (virt & 0x3FFFFF));
+    }
+
+    uint32_t* pte = paging_get_pte(virt);
+    if(!(*pte & PTE_PRESENT))
+    {
+        return(0);
+    }
+    return((*pte & 0xFFFFF000) | (virt & 0xFFF));
+}
+
+//========================================================================================
+/*
+ * Creates a new address space for a task.
+ * It shares every kernel mapping, including our first 4MB, until its program window is touched.
+ */
+address_space_t* paging_create_address_space()
+{
+    address_space_t* space = (address_space_t*)malloc(sizeof(address_space_t));
+    if(!space)
+    {
+        return((void*)0);
+    }
+
+    uint32_t dir = paging_alloc_table();
+    if(!dir)
+    {
+        free(space);
+        return((void*)0);
+    }
+    space->page_dir = (uint32_t*)dir;
+    space->low_table = NULL;
+
+    // paging_map_page() copies new kernel page tables to every space on the list.
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+
+    // Copy the kernel half.
+    memcpy(page_directory, space->page_dir, sizeof(page_directory));
+    space->next = address_space_list;
+    address_space_list = space;
+
+    spin_unlock_irqrestore(&paging_lock, flags);
+    return(space);
+}
+
+//========================================================================================
+/* Frees an address space, its private page table and every frame in its program window. */
+void paging_destroy_address_space(address_space_t* space)
+{
+    if(!space) { return; }
+
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+
+    // Never pull the page tables out from under a cpu.
+    for(int i=0; i<SMP_MAX_CPUS; i++)
+    {
+        if(current_space[i] == space)
+        {
+            spin_unlock_irqrestore(&paging_lock, flags);
+            return;
+        }
+    }
+
+    // Unlink it so kernel page tables stop being copied in.
+    address_space_t** link = &address_space_list;
+    while(*link && *link != space)
+    {
+        link = &(*link)->next;
+    }
+    if(*link)
+    {
+        *link = space->next;
+    }
+
+    spin_unlock_irqrestore(&paging_lock, flags);
+
+    // The program window is the only thing that is ours to free.
+    if(space->low_table)
+    {
+        for(uint32_t virt=USER_IMAGE_BASE; virt<USER_IMAGE_END; virt+=PAGE_SIZE)
+        {
+            // Shared frames are not ours.
+            uint32_t pte = space->low_table[(virt >> 12) & 0x3FF];
+            if((pte & PTE_PRESENT) && !(pte & PTE_COPY_ON_WRITE))
+            {
+                frame_free(pte & 0xFFFFF000);
+            }
+        }
+        frame_free((uint32_t)space->low_table);
+    }
+
+    frame_free((uint32_t)space->page_dir);
+    free(space);
+}
+
+//========================================================================================
+/* Loads an address space into CR3 on this cpu. NULL is the kernel's own. Call with interrupts disabled. */
+void paging_switch_address_space(address_space_t* space)
+{
+    uint32_t cpu = smp_cpu_index();
+    if(space == current_space[cpu]) { return; }
+    current_space[cpu] = space;
+
+    // Kernel mappings are global, so only the program window leaves the TLB.
+    uint32_t dir = space ? (uint32_t)space->page_dir : (uint32_t)&page_directory;
+    asm volatile("mov %0, %%cr3" :: "r"(dir) : "memory");
+}
+
+//========================================================================================
+/*
+ * Helper: Returns a pointer to the PTE for virt in the program window of an address space.
+ * The private page table for the first 4MB is created here, the first time it is needed.
+ * Returns NULL if we are out of memory. Call with paging_lock held.
+ */
+static uint32_t* paging_get_user_pte(address_space_t* space, uint32_t virt)
+{
+    // First touch. Make our own copy of the kernel's first 4MB.
+    if(!space->low_table)
+    {
+        uint32_t table = paging_alloc_table();
+        if(!table)
+        {
+            return(NULL);
+        }
+        memcpy(page_table_low, (void*)table, PAGE_SIZE);
+        space->low_table = (uint32_t*)table;
+        space->page_dir[0] = table | PDE_PRESENT | PDE_READ_WRITE;
+    }
+
+    return(&space->low_table[(virt >> 12) & 0x3FF]);
+}
+
+//========================================================================================
+/*
+ * Backs the page at virt in the program window of an address space with a zeroed frame.
+ * Returns the physical address of the frame (old or new), or 0 if we are out of memory.
+ */
+uint32_t paging_alloc_user_page(address_space_t* space, uint32_t virt, uint32_t pte_flags)
+{
+    if(!space || virt < USER_IMAGE_BASE || virt >= USER_IMAGE_END) { return(0); }
+
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+
+    uint32_t* pte = paging_get_user_pte(space, virt);
+    if(!pte)
+    {
+        spin_unlock_irqrestore(&paging_lock, flags);
+        return(0);
+    }
+
+    if(!(*pte & PTE_PRESENT) || (*pte & PTE_COPY_ON_WRITE))
+    {
+        // We fill the frame through the identity map.
+        uint32_t frame = paging_alloc_table();
+        if(!frame)
+        {
+            spin_unlock_irqrestore(&paging_lock, flags);
+            return(0);
+        }
+
+        // A shared page gets a private copy.
+        if(*pte & PTE_PRESENT)
+        {
+            paging_copy_shared(*pte & 0xFFFFF000, frame);
+        }
+
+        *pte = frame | (pte_flags & 0xFFF) | PTE_PRESENT;
+        if(space == current_space[smp_cpu_index()])
+        {
+            paging_invalidate_page(virt);
+        }
+    }
+
+    uint32_t phys = *pte & 0xFFFFF000;
+    spin_unlock_irqrestore(&paging_lock, flags);
+    return(phys);
+}
+
+//========================================================================================
+/* Helper: Does the work of paging_handle_fault(). Call with paging_lock held. */
+static int paging_fill_user_page(address_space_t* space, uint32_t virt, uint32_t err_code)
+{
+    uint32_t* pte = paging_get_user_pte(space, virt);
+    if(!pte)
+    {
+        return(-1);
+    }
+
+    if(!(err_code & PF_PRESENT))
+    {
+        // First touch.
+        if(!(err_code & PF_WRITE) && paging_zero_frame)
+        {
+            *pte = paging_zero_frame | PTE_COPY_ON_WRITE | PTE_PRESENT;
+        }
+        else
+        {
+            uint32_t frame = paging_alloc_table();
+            if(!frame) { return(-1); }
+            *pte = frame | PTE_READ_WRITE | PTE_PRESENT;
+        }
+        paging_zero_faults++;
+    }
+    else if((err_code & PF_WRITE) && (*pte & PTE_COPY_ON_WRITE))
+    {
+        // First write to a shared page.
+        uint32_t frame = paging_alloc_table();
+        if(!frame) { return(-1); }
+        paging_copy_shared(*pte & 0xFFFFF000, frame);
+        *pte = frame | PTE_READ_WRITE | PTE_PRESENT;
+        paging_cow_faults++;
+    }
+    else
+    {
+        // A real protection fault.
+        return(-1);
+    }
+
+    paging_invalidate_page(virt);
+    return(0);
+}
+
+//========================================================================================
+/*
+ * Resolves a page fault in the program window of the running task. The address is in CR2.
+ *   - A read of a page that was never touched maps the shared zero page read-only.
+ *   - A write of a page that was never touched maps a fresh zeroed frame.
+ *   - A write of a shared read-only page gives the task its own copy.
+ * Called from fault_handler() with interrupts disabled.
+ * Returns 0 if the fault was resolved and the instruction can be restarted, -1 otherwise.
+ */
+int paging_handle_fault(uint32_t err_code)
+{
+    uint32_t virt;
+    asm volatile("mov %%cr2, %0" : "=r"(virt));
+
+    // Only task program windows are filled in on demand.
+    address_space_t* space = current_space[smp_cpu_index()];
+    if(!space || virt < USER_IMAGE_BASE || virt >= USER_IMAGE_END)
+    {
+        return(-1);
+    }
+
+    spin_lock(&paging_lock);
+    int ret = paging_fill_user_page(space, virt, err_code);
+    spin_unlock(&paging_lock);
+    return(ret);
+}
+
+//========================================================================================
+/* Displays how many pages were filled in by the page fault handler. */
+void paging_display_stats()
+{
+    kprintf("page faults  zero-fill  copy-on-write  zero page\n");
+    kprintf("             %d          %d              %xh\n", paging_zero_faults, paging_cow_faults, paging_zero_frame);
+}
+
+//========================================================================================
+/* Translates a program window address of an address space. Returns 0 if it is not mapped. */
+uint32_t paging_get_user_physical(address_space_t* space, uint32_t virt)
+{
+    if(!space || !space->low_table || virt < USER_IMAGE_BASE || virt >= USER_IMAGE_END)
+    {
+        return(0);
+    }
+
+    uint32_t pte = space->low_table[(virt >> 12) & 0x3FF];
+    if(!(pte & PTE_PRESENT))
+    {
+        return(0);
+    }
+    return((pte & 0xFFFFF000) | (virt & 0xFFF));
+}
+
+//========================================================================================
+/* Helper: Times a memcpy and a one-read-per-page walk over src/dst, in cycles. */
+static void paging_time_buffers(uint8_t* src, uint8_t* dst, size_t n, uint32_t* copy_cycles, uint32_t* walk_cycles)
+{
+    // Start both runs with a cold TLB.
+    paging_flush_tlb();
+    uint32_t start = (uint32_t)READ_TSC();
+    memcpy(src, dst, n);
+    *copy_cycles = (uint32_t)READ_TSC() - start;
+
+    paging_flush_tlb();
+    volatile uint32_t sum = 0;
+    start = (uint32_t)READ_TSC();
+    for(size_t offset=0; offset<n; offset+=PAGE_SIZE)
+    {
+        sum += *(volatile uint32_t*)(src + offset);
+    }
+    *walk_cycles = (uint32_t)READ_TSC() - start;
+    (void)sum;
+}
+
+//========================================================================================
+/*
+ * Compares the identity map against 4KiB pages over the same memory.
+ * Two 1MB buffers are used once through the identity map, and once through an alias
+ * in the scratch window that is built from 4KiB pages.
+ */
+#define PAGING_BENCH_PAGES 256
+void paging_benchmark()
+{
+    size_t n = PAGING_BENCH_PAGES * PAGE_SIZE;
+    uint32_t src = frame_alloc_contiguous(PAGING_BENCH_PAGES);
+    uint32_t dst = frame_alloc_contiguous(PAGING_BENCH_PAGES);
+    if(!src || !dst || (src + n) > paging_identity_end || (dst + n) > paging_identity_end)
+    {
+        kprintf("Not enough identity mapped memory for the benchmark.\n");
+        if(src) { frame_free_contiguous(src, PAGING_BENCH_PAGES); }
+        if(dst) { frame_free_contiguous(dst, PAGING_BENCH_PAGES); }
+        return;
+    }
+
+    // Alias both buffers with 4KiB pages.
+    uint32_t alias_src = PAGING_SCRATCH_BASE;
+    uint32_t alias_dst = PAGING_SCRATCH_BASE + n;
+    for(uint32_t i=0; i<PAGING_BENCH_PAGES; i++)
+    {
+        if(paging_map_page(alias_src + (i * PAGE_SIZE), src + (i * PAGE_SIZE), PTE_READ_WRITE | paging_global_flag) != 0 \
+        || paging_map_page(alias_dst + (i * PAGE_SIZE), dst + (i * PAGE_SIZE), PTE_READ_WRITE | paging_global_flag) != 0)
+        {
+            kprintf("Unable to map the scratch window.\n");
+            alias_src = 0;
+            break;
+        }
+    }
+
+    if(alias_src)
+    {
+        uint32_t ident_copy, ident_walk, small_copy, small_walk;
+        paging_time_buffers((uint8_t*)src, (uint8_t*)dst, n, &ident_copy, &ident_walk);
+        paging_time_buffers((uint8_t*)alias_src, (uint8_t*)alias_dst, n, &small_copy, &small_walk);
+
+        kprintf("identity map uses %s pages\n", paging_large_pages ? "4MB" : "4KiB");
+        kprintf("            memcpy 1MB    page walk\n");
+        kprintf("identity    %d      %d cycles\n", ident_copy, ident_walk);
+        kprintf("4KiB pages  %d      %d cycles\n", small_copy, small_walk);
+    }
+
+    // Tear the alias back down and give the frames back.
+    for(uint32_t i=0; i<PAGING_BENCH_PAGES; i++)
+    {
+        paging_unmap_page(PAGING_SCRATCH_BASE + (i * PAGE_SIZE));
+        paging_unmap_page(PAGING_SCRATCH_BASE + n + (i * PAGE_SIZE));
+    }
+    frame_free_contiguous(src, PAGING_BENCH_PAGES);
+    frame_free_contiguous(dst, PAGING_BENCH_PAGES);
+}
@@ -0,0 +1,178 @@
+#include <kernel.h>
+#include <io.h>
+#include <string.h>
+
+// Every cache that has been created, so we can print them all.
+static slab_cache_t* slab_cache_list;
+
+// Guards the cache list and every cache's free list and counters.
+static spinlock_t slab_lock;
+
+// Objects are handed out on our heap's 8-byte boundary.
+#define SLAB_ALIGNMENT 8
+
+//========================================================================================
+/* Creates a cache of obj_size objects, grown objs_per_slab objects at a time. */
+slab_cache_t* slab_cache_create(const char* name, size_t obj_size, uint32_t objs_per_slab)
+{
+    if(obj_size == 0 || objs_per_slab == 0)
+    {
+        return((void*)0);
+    }
+
+    slab_cache_t* cache = (slab_cache_t*)malloc(sizeof(slab_cache_t));
+    if(!cache)
+    {
+        return((void*)0);
+    }
+    memset(cache, 0, sizeof(slab_cache_t));
+
+    // A free object has to be able to hold the free list link.
+    if(obj_size < sizeof(void*))
+    {
+        obj_size = sizeof(void*);
+    }
+
+    // Keep every object in the slab aligned.
+    if(obj_size % SLAB_ALIGNMENT != 0)
+    {
+        obj_size = (obj_size + (SLAB_ALIGNMENT - 1)) & ~(SLAB_ALIGNMENT - 1);
+    }
+
+    for(int i=0; i<15 && name[i]!=0; i++)
+    {
+        cache->name[i] = name[i];
+    }
+    cache->obj_size = obj_size;
+    cache->objs_per_slab = objs_per_slab;
+
+    uint32_t flags = spin_lock_irqsave(&slab_lock);
+    cache->next = slab_cache_list;
+    slab_cache_list = cache;
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    return(cache);
+}
+
+//========================================================================================
+/* Gives every slab of a cache back to the heap. Objects still in use become invalid. */
+void slab_cache_destroy(slab_cache_t* cache)
+{
+    if(!cache) { return; }
+
+    uint32_t flags = spin_lock_irqsave(&slab_lock);
+
+    // Unlink the cache from our list.
+    slab_cache_t** link = &slab_cache_list;
+    while(*link && *link != cache)
+    {
+        link = &(*link)->next;
+    }
+    if(*link)
+    {
+        *link = cache->next;
+    }
+
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    // Free the slabs.
+    struct slab* slab = cache->slabs;
+    while(slab)
+    {
+        struct slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    free(cache);
+}
+
+//========================================================================================
+/* Helper: Threads the objects of a new slab onto the free list. Call with slab_lock held. */
+static void slab_cache_add(slab_cache_t* cache, struct slab* slab)
+{
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    cache->slab_count++;
+    cache->total_objs += cache->objs_per_slab;
+
+    // Chain the new objects in front of whatever is already free.
+    uint8_t* obj = (uint8_t*)slab + sizeof(struct slab);
+    for(uint32_t i=0; i<cache->objs_per_slab; i++)
+    {
+        *(void**)obj = cache->free_list;
+        cache->free_list = obj;
+        obj += cache->obj_size;
+    }
+}
+
+//========================================================================================
+/* Takes one object from the cache. Grows the cache if it has to. */
+void* slab_alloc(slab_cache_t* cache)
+{
+    if(!cache) { return((void*)0); }
+
+    uint32_t flags = spin_lock_irqsave(&slab_lock);
+
+    while(!cache->free_list)
+    {
+        // malloc() may sleep on the heap lock, so grow the cache without holding ours.
+        spin_unlock_irqrestore(&slab_lock, flags);
+        struct slab* slab = (struct slab*)malloc(sizeof(struct slab) + (cache->obj_size * cache->objs_per_slab));
+        flags = spin_lock_irqsave(&slab_lock);
+
+        if(!slab)
+        {
+            spin_unlock_irqrestore(&slab_lock, flags);
+            return((void*)0);
+        }
+        slab_cache_add(cache, slab);
+    }
+
+    // Pop the first free object.
+    void* obj = cache->free_list;
+    cache->free_list = *(void**)obj;
+    cache->used_objs++;
+    cache->alloc_count++;
+
+    spin_unlock_irqrestore(&slab_lock, flags);
+    return(obj);
+}
+
+//========================================================================================
+/* Returns an object to the cache it came from. */
+void slab_free(slab_cache_t* cache, void* obj)
+{
+    if(!cache || !obj) { return; }
+
+    uint32_t flags = spin_lock_irqsave(&slab_lock);
+
+    // Push it back on the free list.
+    *(void**)obj = cache->free_list;
+    cache->free_list = obj;
+    cache->used_objs--;
+    cache->free_count++;
+
+    spin_unlock_irqrestore(&slab_lock, flags);
+}
+
+//========================================================================================
+/* Displays the statistics of every cache. */
+void slab_display_stats()
+{
+    kprintf("cache            size   used/total  slabs     allocs      frees\n");
+    for(slab_cache_t* cache = slab_cache_list; cache; cache = cache->next)
+    {
+        int i;
+        for(i=0; cache->name[i]!=0; i++)
+        {
+            kprintf("%c", cache->name[i]);
+        }
+        for(; i<16; i++)
+        {
+            kprintf(" ");
+        }
+        kprintf(" %d   %d/%d    %d     %d    %d\n", cache->obj_size, cache->used_objs, cache->total_objs, \
+            cache->slab_count, cache->alloc_count, cache->free_count);
+    }
+}
@@ -0,0 +1,284 @@
+#include <kernel.h>
+#include <io.h>
+#include <string.h>
+
+/*
+ * Spinlocks, and sleeping locks built on the wait queues. The state of a sleeping lock is
+ * guarded by the scheduler lock for a few instructions, so checking it and going to sleep
+ * on it is one step for every cpu. Whatever the lock protects runs with interrupts on.
+ */
+
+// Every lock that was set up, for sync_display_stats().
+static mutex_t* mutex_list;
+static semaphore_t* semaphore_list;
+static spinlock_t sync_list_lock;
+
+//========================================================================================
+/*
+ * Takes a spinlock and turns interrupts off on this cpu. Returns whether they were on,
+ * for spin_unlock_irqrestore(). While it waits, interrupts are as the caller had them.
+ */
+uint32_t spin_lock_irqsave(spinlock_t* lock)
+{
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+
+    while(__sync_lock_test_and_set(&lock->locked, 1))
+    {
+        if(ints_enabled) { asm volatile("sti"); }
+        while(lock->locked)
+        {
+            asm volatile("pause");
+        }
+        asm volatile("cli");
+    }
+    return(ints_enabled);
+}
+
+//========================================================================================
+/* Releases a spinlock and turns interrupts back on if they were on before. */
+void spin_unlock_irqrestore(spinlock_t* lock, uint32_t ints_enabled)
+{
+    __sync_lock_release(&lock->locked);
+    if(ints_enabled) { asm volatile("sti"); }
+}
+
+//========================================================================================
+/* Takes a spinlock, leaving interrupts alone. Call with interrupts disabled. */
+void spin_lock(spinlock_t* lock)
+{
+    while(__sync_lock_test_and_set(&lock->locked, 1))
+    {
+        while(lock->locked)
+        {
+            asm volatile("pause");
+        }
+    }
+}
+
+//========================================================================================
+/* Releases a spinlock taken with spin_lock(). */
+void spin_unlock(spinlock_t* lock)
+{
+    __sync_lock_release(&lock->locked);
+}
+
+//========================================================================================
+/* Helper: Copies a lock name. Names longer than 15 characters are cut short. */
+static void sync_set_name(char* dst, const char* name)
+{
+    int i;
+    for(i=0; i<15 && name[i]!=0; i++)
+    {
+        dst[i] = name[i];
+    }
+    for(; i<16; i++)
+    {
+        dst[i] = 0;
+    }
+}
+
+//========================================================================================
+/* Initializes an unlocked mutex. */
+void mutex_init(mutex_t* mutex, const char* name)
+{
+    sync_set_name(mutex->name, name);
+    mutex->locked = 0;
+    mutex->owner = 0;
+    mutex->acquisitions = 0;
+    mutex->contentions = 0;
+    wait_queue_init(&mutex->waiters);
+
+    uint32_t flags = spin_lock_irqsave(&sync_list_lock);
+    mutex->next = mutex_list;
+    mutex_list = mutex;
+    spin_unlock_irqrestore(&sync_list_lock, flags);
+}
+
+//========================================================================================
+/* Takes a mutex. Blocks until it is free. */
+void mutex_lock(mutex_t* mutex)
+{
+    uint32_t flags = sched_lock();
+
+    if(mutex->locked)
+    {
+        mutex->contentions++;
+        while(mutex->locked)
+        {
+            wait_queue_wait(&mutex->waiters, 0);
+        }
+    }
+    mutex->locked = 1;
+    mutex->owner = task_current_id();
+    mutex->acquisitions++;
+
+    sched_unlock(flags);
+}
+
+//========================================================================================
+/* Takes a mutex if it is free. Returns 0 on success, -1 if it is taken. */
+int mutex_trylock(mutex_t* mutex)
+{
+    uint32_t flags = sched_lock();
+
+    int ret = -1;
+    if(!mutex->locked)
+    {
+        mutex->locked = 1;
+        mutex->owner = task_current_id();
+        mutex->acquisitions++;
+        ret = 0;
+    }
+    else
+    {
+        mutex->contentions++;
+    }
+
+    sched_unlock(flags);
+    return(ret);
+}
+
+//========================================================================================
+/* Releases a mutex and wakes the first task waiting for it. */
+void mutex_unlock(mutex_t* mutex)
+{
+    uint32_t flags = sched_lock();
+
+    mutex->locked = 0;
+    mutex->owner = 0;
+
+    sched_unlock(flags);
+    wait_queue_wake_one(&mutex->waiters);
+}
+
+//========================================================================================
+/* Initializes a semaphore with count free units. */
+void semaphore_init(semaphore_t* sem, const char* name, uint32_t count)
+{
+    sync_set_name(sem->name, name);
+    sem->count = count;
+    sem->acquisitions = 0;
+    sem->contentions = 0;
+    wait_queue_init(&sem->waiters);
+
+    uint32_t flags = spin_lock_irqsave(&sync_list_lock);
+    sem->next = semaphore_list;
+    semaphore_list = sem;
+    spin_unlock_irqrestore(&sync_list_lock, flags);
+}
+
+//========================================================================================
+/* Takes one unit. Blocks while there are none left. */
+void semaphore_down(semaphore_t* sem)
+{
+    uint32_t flags = sched_lock();
+
+    if(sem->count == 0)
+    {
+        sem->contentions++;
+        while(sem->count == 0)
+        {
+            wait_queue_wait(&sem->waiters, 0);
+        }
+    }
+    sem->count--;
+    sem->acquisitions++;
+
+    sched_unlock(flags);
+}
+
+//========================================================================================
+/* Takes one unit if there is one. Returns 0 on success, -1 otherwise. */
+int semaphore_trydown(semaphore_t* sem)
+{
+    uint32_t flags = sched_lock();
+
+    int ret = -1;
+    if(sem->count)
+    {
+        sem->count--;
+        sem->acquisitions++;
+        ret = 0;
+    }
+    else
+    {
+        sem->contentions++;
+    }
+
+    sched_unlock(flags);
+    return(ret);
+}
+
+//========================================================================================
+/* Gives one unit back and wakes a waiter. Safe to call from interrupt handlers. */
+void semaphore_up(semaphore_t* sem)
+{
+    uint32_t flags = sched_lock();
+
+    sem->count++;
+
+    sched_unlock(flags);
+    wait_queue_wake_one(&sem->waiters);
+}
+
+//========================================================================================
+/* Initializes an event with no bits pending. */
+void event_init(event_t* event)
+{
+    event->pending = 0;
+    wait_queue_init(&event->waiters);
+}
+
+//========================================================================================
+/* Sets event bits and wakes everyone waiting on the event. Safe to call from interrupt handlers. */
+void event_signal(event_t* event, uint32_t bits)
+{
+    uint32_t flags = sched_lock();
+
+    event->pending |= bits;
+
+    sched_unlock(flags);
+    wait_queue_wake_all(&event->waiters);
+}
+
+//========================================================================================
+/* Blocks until any bit in mask is pending. Clears those bits and returns them. */
+uint32_t event_wait(event_t* event, uint32_t mask)
+{
+    uint32_t flags = sched_lock();
+
+    while(!(event->pending & mask))
+    {
+        wait_queue_wait(&event->waiters, 0);
+    }
+    uint32_t bits = event->pending & mask;
+    event->pending &= ~bits;
+
+    sched_unlock(flags);
+    return(bits);
+}
+
+//========================================================================================
+/* Displays how often each lock was taken, and how often someone had to wait for it. */
+void sync_display_stats()
+{
+    kprintf("lock             type   held by   taken  contended\n");
+
+    uint32_t flags = spin_lock_irqsave(&sync_list_lock);
+    for(mutex_t* mutex = mutex_list; mutex; mutex = mutex->next)
+    {
+        kprintf("%s", mutex->name);
+        for(int i=strlen(mutex->name); i<17; i++) { kprintf(" "); }
+        if(mutex->locked) { kprintf("mutex  %d         ", mutex->owner); }
+        else              { kprintf("mutex  -         "); }
+        kprintf("%d  %d\n", mutex->acquisitions, mutex->contentions);
+    }
+    for(semaphore_t* sem = semaphore_list; sem; sem = sem->next)
+    {
+        kprintf("%s", sem->name);
+        for(int i=strlen(sem->name); i<17; i++) { kprintf(" "); }
+        kprintf("sem    %d free    %d  %d\n", sem->count, sem->acquisitions, sem->contentions);
+    }
+    spin_unlock_irqrestore(&sync_list_lock, flags);
+}
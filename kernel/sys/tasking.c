@@ -1,82 +1,472 @@
 #include <kernel.h>
 #include <io.h>
 #include <string.h>
+#include <pit.h>
 
-// The table of all tasks in the system
-static struct task task_table[MAX_TASKS];
+// Every task in the system, and the same tasks hashed by id.
+static struct task* task_list_head;
+static struct task* task_hash[TASK_HASH_SIZE];
 
-// The index of the currently running task in the task_table
-static volatile uint32_t current_task;
+// The next id to hand out. 0 is kernel_main.
+static uint32_t task_next_id;
+
+// Task control blocks come from their own cache.
+static slab_cache_t* task_cache;
+
+// Guards the task list, the id hash and task_next_id. Nothing touches them from interrupts.
+// The list and the hash only change with the scheduler lock held too, so task_find() may use either.
+static mutex_t task_list_mutex;
+
+// Guards the run queues, the sleep queue, every wait queue and the per cpu state in smp_cpus[].
+// It is what cli used to be when there was only one cpu.
+static spinlock_t task_sched_lock;
 
 // Flag to prevent scheduling before tasking is initialized
 volatile uint8_t tasking_enabled;
 
+// Every task stack is the same size, so they come from their own cache.
+static slab_cache_t* stack_cache;
+
+// Each cpu has its own run queues, in smp_cpus[].
+// Runnable tasks that still have time left in their slice are in the active queues.
+// Tasks that used up their slice wait in the expired queues until the active ones run dry.
+// Then the two swap, so every runnable task gets a turn, whatever its priority.
+// The running task itself is in neither. A cpu with nothing left takes work from the busiest one.
+
+// Sleeping tasks, sorted by wake up time. Each sleep_delta is relative to the task before it,
+// so the timer only ever has to look at the head of the queue. Only the boot cpu's timer does.
+static struct task* sleep_queue;
+
+// Woken whenever a task exits.
+static wait_queue_t task_exit_queue;
+
+// Exited tasks waiting for the reaper task, linked through 'next'. It sleeps on the queue.
+static struct task* task_zombie_list;
+static wait_queue_t task_reaper_queue;
+static void task_reaper();
+
+// What task_display_top() measures against. Uptime in ms at its last call.
+static uint32_t task_top_ms;
+
 //========================================================================================
-/* Initializes the multi-tasking system. */
-void tasking_init()
+/* Helper: Returns the time slice a task of the given priority starts with, in ticks. */
+static uint32_t task_default_slice(uint8_t priority)
 {
-    // Clear the task table with all 0's.
-    memset(task_table, 0, sizeof(struct task)*MAX_TASKS);
+    // Higher priorities get longer slices. 70ms for interactive tasks down to 20ms for idle ones.
+    return(2 + ((TASK_PRIORITY_LEVELS - 1 - priority) / 4));
+}
 
-    // Initialize Task 0.
-    const char* name = "kernel_main";
-    current_task = 0;
-    task_table[current_task].state = TASK_STATE_RUNNING;
-    task_table[current_task].esp = 0;
-    task_table[current_task].stack_base = 0;
-    for(int i=0; i<12; i++)
+//========================================================================================
+/* Helper: Adds a task to the task list and the id hash. Call with the scheduler lock held. */
+static void task_register(struct task* task)
+{
+    uint32_t bucket = task->id & (TASK_HASH_SIZE - 1);
+    task->hash_next = task_hash[bucket];
+    task_hash[bucket] = task;
+    task->all_next = task_list_head;
+    task_list_head = task;
+}
+
+//========================================================================================
+/* Helper: Removes a task from the task list and the id hash. Call with the scheduler lock held. */
+static void task_unregister(struct task* task)
+{
+    uint32_t bucket = task->id & (TASK_HASH_SIZE - 1);
+    struct task* prev = NULL;
+    for(struct task* entry = task_hash[bucket]; entry; prev = entry, entry = entry->hash_next)
     {
-        task_table[current_task].name[i] = name[i];
+        if(entry == task)
+        {
+            if(prev) { prev->hash_next = task->hash_next; }
+            else     { task_hash[bucket] = task->hash_next; }
+            break;
+        }
     }
 
-    // Enable the scheduler
-    tasking_enabled = 1;
+    prev = NULL;
+    for(struct task* entry = task_list_head; entry; prev = entry, entry = entry->all_next)
+    {
+        if(entry == task)
+        {
+            if(prev) { prev->all_next = task->all_next; }
+            else     { task_list_head = task->all_next; }
+            break;
+        }
+    }
 }
 
 //========================================================================================
-/* Creates a new task and adds it to the task table. */
-int task_exec(void (*task_function)(void), const char* name)
+/* Returns the task with the given id, or NULL. Hold the scheduler lock if you keep it. */
+struct task* task_find(uint32_t id)
 {
+    for(struct task* task = task_hash[id & (TASK_HASH_SIZE - 1)]; task; task = task->hash_next)
+    {
+        if(task->id == id) { return(task); }
+    }
+    return(NULL);
+}
+
+//========================================================================================
+/* Returns the running task, or NULL before tasking is up. */
+struct task* task_current()
+{
+    // With interrupts off we can't be moved to another cpu halfway through.
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
     asm volatile("cli");
-    int task_index = -1;
+    struct task* task = smp_cpu()->current;
+    if(ints_enabled) { asm volatile("sti"); }
+    return(task);
+}
+
+//========================================================================================
+/* Returns the id of the running task. */
+uint32_t task_current_id()
+{
+    struct task* task = task_current();
+    return(task ? task->id : 0);
+}
+
+//========================================================================================
+/* Takes the scheduler lock. Returns whether interrupts were on, for sched_unlock(). */
+uint32_t sched_lock()
+{
+    return(spin_lock_irqsave(&task_sched_lock));
+}
 
-    for(int i=0; i<MAX_TASKS; i++)
+//========================================================================================
+/* Releases the scheduler lock. */
+void sched_unlock(uint32_t flags)
+{
+    spin_unlock_irqrestore(&task_sched_lock, flags);
+}
+
+//========================================================================================
+/* Helper: Adds a task to the tail of its priority's list. Call with the scheduler lock held. */
+static void run_queue_add(run_queue_t* queue, struct task* task)
+{
+    uint8_t priority = task->priority;
+    task->next = NULL;
+    if(queue->tail[priority])
     {
-        if(strncmp(name, task_table[i].name, strlen(name))==0)
+        queue->tail[priority]->next = task;
+    }
+    else
+    {
+        queue->head[priority] = task;
+    }
+    queue->tail[priority] = task;
+    queue->bitmap |= (1 << priority);
+}
+
+//========================================================================================
+/*
+ * Helper: Removes and returns the first task of the highest priority, or NULL.
+ * Tasks some other cpu is still switching away from are left where they are.
+ * Call with the scheduler lock held.
+ */
+static struct task* run_queue_pop(run_queue_t* queue, struct task* current)
+{
+    // The lowest set bit is the highest priority with a runnable task.
+    for(uint32_t bitmap = queue->bitmap; bitmap; bitmap &= bitmap - 1)
+    {
+        uint8_t priority = __builtin_ctz(bitmap);
+        struct task* prev = NULL;
+        for(struct task* task = queue->head[priority]; task; prev = task, task = task->next)
         {
-            asm volatile("sti");
-            return(task_index);
+            if(task->on_cpu && task != current) { continue; }
+
+            if(prev) { prev->next = task->next; }
+            else     { queue->head[priority] = task->next; }
+            if(queue->tail[priority] == task) { queue->tail[priority] = prev; }
+            if(!queue->head[priority])
+            {
+                queue->bitmap &= ~(1 << priority);
+            }
+            task->next = NULL;
+            return(task);
         }
     }
+    return(NULL);
+}
+
+//========================================================================================
+/*
+ * Helper: Queues a runnable task on its cpu. A task that used up its slice waits in the
+ * expired queue with a fresh one. Call with the scheduler lock held.
+ */
+static void task_enqueue(struct task* task)
+{
+    cpu_t* cpu = &smp_cpus[task->cpu];
+    if(task->slice_left == 0)
+    {
+        task->slice_left = task->time_slice * PIT_COUNTS_PER_TICK;
+        run_queue_add(cpu->expired, task);
+    }
+    else
+    {
+        run_queue_add(cpu->active, task);
+    }
+    cpu->queued++;
+}
+
+//========================================================================================
+/*
+ * Helper: Tells a cpu that a task was queued on it, and gets an idle cpu to come and take it
+ * if the first one is busy. Our own cpu is left to the caller. Call with the scheduler lock held.
+ */
+static void task_kick(cpu_t* cpu)
+{
+    uint32_t self = smp_cpu_index();
+    if(cpu->index != self)
+    {
+        smp_send_resched(cpu->index);
+    }
+    if(cpu->current == cpu->idle) { return; }
 
-    // Find a free task slot
-    for(int i=0; i<MAX_TASKS; i++)
+    for(uint32_t i=0; i<smp_cpu_count; i++)
     {
-        if (task_table[i].state == TASK_STATE_FREE)
+        cpu_t* other = &smp_cpus[i];
+        if(other != cpu && i != self && other->online && other->current == other->idle)
         {
-            task_index = i;
-            break;
+            smp_send_resched(i);
+            return;
+        }
+    }
+}
+
+//========================================================================================
+/* Helper: Takes a task from the cpu with the most queued, or returns NULL. Call with the scheduler lock held. */
+static struct task* task_steal(cpu_t* cpu)
+{
+    cpu_t* busiest = NULL;
+    for(uint32_t i=0; i<smp_cpu_count; i++)
+    {
+        cpu_t* other = &smp_cpus[i];
+        if(other == cpu || !other->online || !other->queued) { continue; }
+        if(!busiest || other->queued > busiest->queued)
+        {
+            busiest = other;
+        }
+    }
+    if(!busiest) { return(NULL); }
+
+    // Its active tasks are the ones waiting for a turn right now.
+    struct task* task = run_queue_pop(busiest->active, NULL);
+    if(!task)
+    {
+        task = run_queue_pop(busiest->expired, NULL);
+        if(!task) { return(NULL); }
+    }
+    busiest->queued--;
+    task->cpu = cpu->index;
+    cpu->steals++;
+    return(task);
+}
+
+//========================================================================================
+/* Helper: Returns the least busy cpu, for a new task. Call with the scheduler lock held. */
+static uint8_t task_pick_cpu()
+{
+    uint32_t best = smp_cpu_index();
+    uint32_t best_load = 0xFFFFFFFF;
+    for(uint32_t i=0; i<smp_cpu_count; i++)
+    {
+        cpu_t* cpu = &smp_cpus[i];
+        if(!cpu->online) { continue; }
+
+        // Whatever it is running counts too, unless it is idling.
+        uint32_t load = cpu->queued + (cpu->current != cpu->idle);
+        if(load < best_load || (load == best_load && i == smp_cpu_index()))
+        {
+            best = i;
+            best_load = load;
         }
     }
+    return((uint8_t)best);
+}
+
+//========================================================================================
+/* Helper: Adds a task to the sleep queue, due in 'counts' PIT counts. Call with the scheduler lock held. */
+static void sleep_queue_insert(struct task* task, uint32_t counts)
+{
+    // The timer charges everything since its last update at once, so sleep from there.
+    counts += timer_elapsed();
+
+    // Find our place in the sleep queue, turning counts into a delta as we go.
+    struct task* prev = NULL;
+    struct task* after = sleep_queue;
+    while(after && after->sleep_delta <= counts)
+    {
+        counts -= after->sleep_delta;
+        prev = after;
+        after = after->next;
+    }
 
-    // No free slots
-    if(task_index == -1) 
+    // The task after us is now relative to us.
+    if(after)
     {
-        asm volatile("sti");
-        return(task_index);
+        after->sleep_delta -= counts;
     }
+    task->sleep_delta = counts;
+    task->next = after;
+    if(prev) { prev->next = task; }
+    else     { sleep_queue = task; }
+    task->in_sleep_queue = 1;
 
-    // Allocate a stack for the task.
-    uint8_t* stack = (uint8_t*)malloc(STACK_SIZE);
-    if(!stack) 
+    // The boot cpu's timer counts down to the old head. Tell it about the earlier deadline.
+    if(!prev && smp_cpu_index() != 0)
     {
-        asm volatile("sti");
-        return(-1); // Malloc failed
+        smp_send_resched(0);
+    }
+}
+
+//========================================================================================
+/* Helper: Takes a task out of the sleep queue before its time. Call with the scheduler lock held. */
+static void sleep_queue_remove(struct task* task)
+{
+    struct task* prev = NULL;
+    struct task* entry = sleep_queue;
+    while(entry && entry != task)
+    {
+        prev = entry;
+        entry = entry->next;
+    }
+    if(!entry) { return; }
+
+    // The task after us inherits our delta.
+    if(task->next)
+    {
+        task->next->sleep_delta += task->sleep_delta;
+    }
+    if(prev) { prev->next = task->next; }
+    else     { sleep_queue = task->next; }
+    task->next = NULL;
+    task->in_sleep_queue = 0;
+}
+
+//========================================================================================
+/* Helper: Takes a blocked task off the wait queue it is on. Call with the scheduler lock held. */
+static void wait_queue_remove(struct task* task)
+{
+    wait_queue_t* queue = task->wait_queue;
+    if(!queue) { return; }
+
+    struct task* prev = NULL;
+    struct task* entry = queue->head;
+    while(entry && entry != task)
+    {
+        prev = entry;
+        entry = entry->wait_next;
+    }
+    if(entry)
+    {
+        if(prev) { prev->wait_next = task->wait_next; }
+        else     { queue->head = task->wait_next; }
+        if(queue->tail == task) { queue->tail = prev; }
+    }
+    task->wait_next = NULL;
+    task->wait_queue = NULL;
+}
+
+//========================================================================================
+/*
+ * Helper: Returns the uptime in ms for the task statistics. Call with the scheduler lock held.
+ * The TSC is cheap to read. Without one we have to ask the PIT.
+ */
+static uint32_t task_now_ms()
+{
+    return(clock_get_khz() ? clock_get_ms() : timer_now_ms());
+}
+
+//========================================================================================
+/* Helper: Adds PIT counts to the time a task spent on a cpu. */
+static void task_charge(struct task* task, uint32_t counts)
+{
+    counts += task->run_counts;
+    task->run_ticks += counts / PIT_COUNTS_PER_TICK;
+    task->run_counts = counts % PIT_COUNTS_PER_TICK;
+}
+
+//========================================================================================
+/* Helper: Makes a task runnable again on its cpu. Call with the scheduler lock held. */
+static void task_wake(struct task* task)
+{
+    if(task->state == TASK_STATE_SLEEPING || task->state == TASK_STATE_BLOCKED)
+    {
+        task->sleep_ms += task_now_ms() - task->sleep_since;
+    }
+
+    // A timed wait that ran out of time.
+    if(task->state == TASK_STATE_BLOCKED && task->wait_queue)
+    {
+        wait_queue_remove(task);
+        task->wait_timed_out = 1;
+    }
+
+    task->state = TASK_STATE_RUNNING;
+
+    // The running task isn't kept in a queue. schedule() takes care of it.
+    // Its cpu may be just about to switch away from it, so make it look again.
+    cpu_t* cpu = &smp_cpus[task->cpu];
+    if(task == cpu->current)
+    {
+        if(cpu->index != smp_cpu_index())
+        {
+            smp_send_resched(cpu->index);
+        }
+        return;
+    }
+
+    task_enqueue(task);
+    task_kick(cpu);
+}
+
+//========================================================================================
+/* Helper: The idle task of a cpu. Sleeps until an interrupt brings something to do. */
+static void task_idle()
+{
+    while(1)
+    {
+        asm volatile("sti; hlt");
+    }
+}
+
+//========================================================================================
+/* Helper: Sets up a task with a fresh stack that starts in task_function. Returns NULL if we are out of memory. */
+static struct task* task_create(void (*task_function)(void), const char* name, address_space_t* space, uint8_t priority)
+{
+    if(priority >= TASK_PRIORITY_LEVELS)
+    {
+        priority = TASK_PRIORITY_LEVELS - 1;
+    }
+
+    // Allocate a task control block and a stack for the task.
+    struct task* task = (struct task*)slab_alloc(task_cache);
+    if(!task)
+    {
+        return(NULL); // Allocation failed
+    }
+    memset(task, 0, sizeof(struct task));
+
+    uint8_t* stack = (uint8_t*)slab_alloc(stack_cache);
+    if(!stack)
+    {
+        slab_free(task_cache, task);
+        return(NULL); // Allocation failed
+    }
+
+    // The FPU save area too, so the #NM trap never has to allocate.
+    if(fpu_task_init(task) != 0)
+    {
+        slab_free(stack_cache, stack);
+        slab_free(task_cache, task);
+        return(NULL); // Allocation failed
     }
     uint32_t stack_top = (uint32_t)(stack + STACK_SIZE);
 
     // Preload the stack.
     uint32_t* stack_ptr = (uint32_t*)stack_top;
+    *--stack_ptr = (uint32_t)task_kill; // Return address, if the task function ever returns.
     *--stack_ptr = 0x202;   // EFLAGS (Interrupts Enabled)
     *--stack_ptr = 0x08;    // CODE_SEG
     *--stack_ptr = (uint32_t)task_function; // EIP
@@ -90,153 +480,640 @@ int task_exec(void (*task_function)(void), const char* name)
     *--stack_ptr = 0; // EDI
 
     // Save the new task's state
-    task_table[task_index].esp = (uint32_t)stack_ptr;
-    task_table[task_index].stack_base = (uint32_t)stack;
-    task_table[task_index].state = TASK_STATE_RUNNING; // Set as running
-    for(int i=0; name[i]!=0; i++)
+    task->esp = (uint32_t)stack_ptr;
+    task->stack_base = (uint32_t)stack;
+    task->state = TASK_STATE_RUNNING; // Set as running
+    task->space = space;
+    task->priority = priority;
+    task->time_slice = task_default_slice(priority);
+    task->slice_left = task->time_slice * PIT_COUNTS_PER_TICK;
+    for(int i=0; name[i]!=0 && i<23; i++)
+    {
+        task->name[i] = name[i];
+    }
+
+    mutex_lock(&task_list_mutex);
+
+    // Skip ids still in use, in case we ever wrap around.
+    while(task_next_id == 0 || task_find(task_next_id))
     {
-        task_table[task_index].name[i] = name[i];
+        task_next_id++;
     }
+    task->id = task_next_id++;
+
+    uint32_t flags = sched_lock();
+    task_register(task);
+    sched_unlock(flags);
 
-    asm volatile("sti");
-    return(0); // Success
+    mutex_unlock(&task_list_mutex);
+    return(task);
 }
 
 //========================================================================================
-/* Called by the timer interrupt handler every tick */
-void task_tick()
+/* Initializes the multi-tasking system on the boot cpu. */
+void tasking_init()
 {
-    for(int i=0; i<MAX_TASKS; i++)
+    // Task control blocks are handed out eight at a time, stacks four at a time.
+    task_cache = slab_cache_create("task", sizeof(struct task), 8);
+    stack_cache = slab_cache_create("task_stack", STACK_SIZE, 4);
+
+    memset(task_hash, 0, sizeof(task_hash));
+    sleep_queue = NULL;
+    task_list_head = NULL;
+    wait_queue_init(&task_exit_queue);
+    task_zombie_list = NULL;
+    wait_queue_init(&task_reaper_queue);
+    mutex_init(&task_list_mutex, "task_list");
+
+    // The boot cpu. smp_init() brings up the others once we are done here.
+    cpu_t* cpu = &smp_cpus[0];
+    memset(cpu->run_queues, 0, sizeof(cpu->run_queues));
+    cpu->active = &cpu->run_queues[0];
+    cpu->expired = &cpu->run_queues[1];
+    cpu->queued = 0;
+    cpu->preempt_pending = 0;
+    cpu->yield_requested = 0;
+    cpu->online = 1;
+
+    // Initialize Task 0. It runs on the boot stack.
+    struct task* task = (struct task*)slab_alloc(task_cache);
+    if(!task)
     {
-        if(task_table[i].state == TASK_STATE_SLEEPING)
-        {
-            // Decrement the timer
-            if(task_table[i].sleep_ticks > 0) {
-                task_table[i].sleep_ticks--;
-            }
+        kprintf("Unable to allocate the first task.\n");
+        SYSTEM_HALT();
+    }
+    memset(task, 0, sizeof(struct task));
+    if(fpu_task_init(task) != 0)
+    {
+        kprintf("Unable to allocate the first task's fpu state.\n");
+        SYSTEM_HALT();
+    }
 
-            // If timer runs out, wake the task up
-            if(task_table[i].sleep_ticks == 0) {
-                task_table[i].state = TASK_STATE_RUNNING;
-            }
+    const char* name = "kernel_main";
+    task->id = 0;
+    task->state = TASK_STATE_RUNNING;
+    task->esp = 0;
+    task->stack_base = 0;
+    task->priority = TASK_PRIORITY_IDLE;
+    task->time_slice = task_default_slice(TASK_PRIORITY_IDLE);
+    task->slice_left = task->time_slice * PIT_COUNTS_PER_TICK;
+    task->cpu = 0;
+    task->on_cpu = 1;
+    for(int i=0; i<12; i++)
+    {
+        task->name[i] = name[i];
+    }
+    task_register(task);
+    task_next_id = 1;
+    cpu->current = task;
+
+    cpu->idle = task_create_idle(0);
+    if(!cpu->idle)
+    {
+        kprintf("Unable to start the idle task.\n");
+        SYSTEM_HALT();
+    }
+
+    // Enable the scheduler
+    tasking_enabled = 1;
+
+    // Just above kernel_main. Exited tasks can wait until there is nothing better to do.
+    if(task_exec(task_reaper, "reaper", TASK_PRIORITY_IDLE - 1) < 0)
+    {
+        kprintf("Unable to start the reaper.\n");
+        SYSTEM_HALT();
+    }
+}
+
+//========================================================================================
+/*
+ * Creates the idle task of a cpu. It is never queued, and only runs when the cpu has
+ * nothing else to do. An application processor starts out on its stack.
+ * Returns NULL if we are out of memory.
+ */
+struct task* task_create_idle(uint32_t cpu)
+{
+    struct task* task = task_create(task_idle, "idle", NULL, TASK_PRIORITY_IDLE);
+    if(task)
+    {
+        task->cpu = cpu;
+    }
+    return(task);
+}
+
+//========================================================================================
+/* Creates a new task in the kernel's address space. Returns its id, or -1. */
+int task_exec(void (*task_function)(void), const char* name, uint8_t priority)
+{
+    return(task_exec_space(task_function, name, NULL, priority));
+}
+
+//========================================================================================
+/*
+ * Creates a new task that runs in its own address space. Returns its id, or -1.
+ * The task owns the address space from here on. The reaper destroys it.
+ * Names are only for show. Any number of tasks can share one.
+ */
+int task_exec_space(void (*task_function)(void), const char* name, address_space_t* space, uint8_t priority)
+{
+    struct task* task = task_create(task_function, name, space, priority);
+    if(!task)
+    {
+        return(-1);
+    }
+
+    // A new task starts with a full slice, on whichever cpu has the least to do.
+    uint32_t flags = sched_lock();
+    task->cpu = task_pick_cpu();
+    task_enqueue(task);
+    task_kick(&smp_cpus[task->cpu]);
+
+    sched_unlock(flags);
+    return((int)task->id); // Success
+}
+
+//========================================================================================
+/* Called by a cpu's timer with the PIT counts that passed since its last call. Call with the scheduler lock held. */
+void task_tick(uint32_t counts)
+{
+    cpu_t* cpu = smp_cpu();
+
+    // Charge the time to the running task and its slice.
+    if(tasking_enabled)
+    {
+        struct task* current = cpu->current;
+        current->slice_left = (current->slice_left > counts) ? current->slice_left - counts : 0;
+        task_charge(current, counts);
+    }
+
+    // The sleepers are the boot cpu's business.
+    if(cpu->index != 0) { return; }
+
+    // Wake up every task whose time has come. Each delta is relative to the one before it.
+    while(sleep_queue && sleep_queue->sleep_delta <= counts)
+    {
+        struct task* task = sleep_queue;
+        counts -= task->sleep_delta;
+        sleep_queue = task->next;
+        task->next = NULL;
+        task->in_sleep_queue = 0;
+        task_wake(task);
+    }
+
+    // Only the first task's delta counts down. Everyone behind it is relative to it.
+    if(sleep_queue)
+    {
+        sleep_queue->sleep_delta -= counts;
+    }
+}
+
+//========================================================================================
+/*
+ * Returns the PIT counts until this cpu's timer is needed again. Call with the scheduler lock held.
+ * That is the first sleep deadline on the boot cpu, or the end of the running task's slice
+ * if anyone else is waiting to run. With nothing to do the cpu is left alone.
+ */
+uint32_t task_next_event()
+{
+    uint32_t next = 0xFFFFFFFF;
+    if(!tasking_enabled) { return(next); }
+
+    // Someone else should have the cpu right away if the running task stopped,
+    // or a higher priority task is waiting.
+    cpu_t* cpu = smp_cpu();
+    struct task* current = cpu->current;
+    uint32_t waiting = cpu->active->bitmap | cpu->expired->bitmap;
+
+    if(current == cpu->idle)
+    {
+        // Anything runnable beats idling.
+        if(waiting) { return(0); }
+    }
+    else
+    {
+        // Nobody may take the cpu from us. Only the sleepers need the timer.
+        if(current->preempt_count && current->state == TASK_STATE_RUNNING)
+        {
+            waiting = 0;
         }
+        if(waiting && current->state != TASK_STATE_RUNNING) { return(0); }
+        if(waiting && cpu->active->bitmap && (uint8_t)__builtin_ctz(cpu->active->bitmap) < current->priority) { return(0); }
+    }
+
+    if(cpu->index == 0 && sleep_queue)
+    {
+        next = sleep_queue->sleep_delta;
+    }
+
+    if(waiting && current->slice_left < next)
+    {
+        next = current->slice_left;
     }
+    return(next);
 }
 
 //========================================================================================
-/* Puts the current task to sleep for 'ticks' amount of time */
-void task_sleep(uint32_t ticks)
+/*
+ * Helper: Gives up the cpu once the current task stopped being runnable, and returns when
+ * it runs again. Call with the scheduler lock held. The lock is dropped in between, but
+ * interrupts stay off until the switch, so a wake up can't slip past us.
+ */
+static void task_block()
 {
-    asm volatile("cli");
+    spin_unlock(&task_sched_lock);
+    task_yield();
+    spin_lock(&task_sched_lock);
+}
 
-    // Set the sleep duration and change state
-    task_table[current_task].sleep_ticks = ticks;
-    task_table[current_task].state = TASK_STATE_SLEEPING;
+//========================================================================================
+/* Helper: Puts the current task to sleep for 'counts' PIT counts. */
+static void task_sleep_counts(uint32_t counts)
+{
+    uint32_t flags = sched_lock();
+
+    struct task* task = smp_cpu()->current;
+    sleep_queue_insert(task, counts);
+    task->state = TASK_STATE_SLEEPING;
+    task->sleep_since = task_now_ms();
+
+    // Hand the cpu over now. We come back here once we are woken up.
+    task_block();
 
-    asm volatile("sti");
+    sched_unlock(flags);
+}
+
+//========================================================================================
+/* Puts the current task to sleep for 'ticks' amount of time (10ms each) */
+void task_sleep(uint32_t ticks)
+{
+    // Keep clear of overflowing the PIT counts. That is about an hour.
+    if(ticks > 0xFFFFFFFF / PIT_COUNTS_PER_TICK)
+    {
+        ticks = 0xFFFFFFFF / PIT_COUNTS_PER_TICK;
+    }
+    task_sleep_counts(ticks * PIT_COUNTS_PER_TICK);
+}
 
-    // Halt the TASK. This waits for the next interrupt (timer),
-    // which will trigger the scheduler. Since we marked ourselves
-    // as SLEEPING, the scheduler will switch to another task.
-    while(task_table[current_task].state == TASK_STATE_SLEEPING)
+//========================================================================================
+/* Puts the current task to sleep for 'ms' milliseconds */
+void task_sleep_ms(uint32_t ms)
+{
+    // There are 1193.182 counts in a millisecond. Over an hour doesn't fit 32 bits.
+    uint64_t counts = ((uint64_t)ms * PIT_COUNTS_PER_MS) + ((ms / 1000) * 182);
+    if(counts > 0xFFFFFFFF)
     {
-        asm volatile("hlt");
+        counts = 0xFFFFFFFF;
     }
+    task_sleep_counts((uint32_t)counts);
 }
 
 //========================================================================================
-/* Cleans up memory and task state for any zombie tasks. */
-void reaper()
+/* Sets the time slice of the current task, in ticks. It takes effect with the next slice. */
+void task_set_time_slice(uint32_t ticks)
 {
-    // Since this is only called via user input in kshell, ints must be enabled.
-    asm volatile("cli");
+    if(ticks == 0) { ticks = 1; }
+    task_current()->time_slice = ticks;
+}
+
+//========================================================================================
+/* Initializes an empty wait queue. */
+void wait_queue_init(wait_queue_t* queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+//========================================================================================
+/*
+ * Blocks the current task on a wait queue until it is woken, or timeout_ms passed (0 = never).
+ * Call with the scheduler lock held, right after finding the condition you wait for is false.
+ * Returns with the lock held, so the condition can be checked again safely.
+ * Returns 0 when woken, -1 on a timeout. Before tasking is up this just waits for any interrupt.
+ */
+int wait_queue_wait(wait_queue_t* queue, uint32_t timeout_ms)
+{
+    if(!tasking_enabled)
+    {
+        // The interrupt we wait for may need the lock.
+        spin_unlock(&task_sched_lock);
+        asm volatile("sti; hlt; cli");
+        spin_lock(&task_sched_lock);
+        return(0);
+    }
+
+    struct task* task = smp_cpu()->current;
+    task->wait_queue = queue;
+    task->wait_next = NULL;
+    task->wait_timed_out = 0;
+    if(queue->tail) { queue->tail->wait_next = task; }
+    else            { queue->head = task; }
+    queue->tail = task;
 
-    for(int i=0; i<MAX_TASKS; i++)
+    if(timeout_ms)
     {
-        if(task_table[i].state == TASK_STATE_ZOMBIE)
+        if(timeout_ms > 0xFFFFFFFF / PIT_COUNTS_PER_MS)
         {
-            // Free the task's stack
-            free((void*)task_table[i].stack_base);
-
-            // Mark the slot as free
-            task_table[i].state = TASK_STATE_FREE;
-            task_table[i].stack_base = 0;
-            task_table[i].esp = 0;
-            memset(task_table[i].name, 0, 24);
+            timeout_ms = 0xFFFFFFFF / PIT_COUNTS_PER_MS;
         }
+        sleep_queue_insert(task, timeout_ms * PIT_COUNTS_PER_MS);
+    }
+    task->state = TASK_STATE_BLOCKED;
+    task->sleep_since = task_now_ms();
+
+    // We are off the run queues. Hand the cpu over now.
+    task_block();
+
+    return(task->wait_timed_out ? -1 : 0);
+}
+
+//========================================================================================
+/* Helper: Wakes a task blocked on a wait queue. Call with the scheduler lock held. */
+static void wait_queue_wake_task(struct task* task)
+{
+    wait_queue_remove(task);
+    if(task->in_sleep_queue)
+    {
+        sleep_queue_remove(task);
+    }
+    task_wake(task);
+}
+
+//========================================================================================
+/* Wakes the first task on a wait queue. Safe to call from interrupt handlers. */
+void wait_queue_wake_one(wait_queue_t* queue)
+{
+    uint32_t flags = sched_lock();
+
+    uint8_t resched = 0;
+    if(queue->head)
+    {
+        wait_queue_wake_task(queue->head);
+
+        // Let it preempt us if it outranks us.
+        resched = (task_next_event() == 0);
     }
 
-    asm volatile("sti");
+    sched_unlock(flags);
+    if(resched) { timer_sync(); }
 }
 
 //========================================================================================
-/* ... */
-void wait_for_task(const char* s)
+/* Wakes every task on a wait queue. Safe to call from interrupt handlers. */
+void wait_queue_wake_all(wait_queue_t* queue)
 {
-    static uint8_t is_active = 0;
+    uint32_t flags = sched_lock();
 
-    int i;
-    for(i=0; i<MAX_TASKS; i++)
+    uint8_t resched = 0;
+    if(queue->head)
     {
-        if(strncmp(s, task_table[i].name, strlen(s))==0 \
-        && strlen(s) == strlen(task_table[i].name))
+        while(queue->head)
         {
-            is_active = 1;
-            break;
+            wait_queue_wake_task(queue->head);
         }
+
+        // Let them preempt us if they outrank us.
+        resched = (task_next_event() == 0);
     }
 
-    if(is_active)
+    sched_unlock(flags);
+    if(resched) { timer_sync(); }
+}
+
+//========================================================================================
+/*
+ * The reaper task. Sleeps until a task exits, then frees its stack, address space and
+ * control block. A zombie is off the run queues for good, so only the task list needs a lock.
+ */
+static void task_reaper()
+{
+    while(1)
     {
-        while(task_table[i].state == TASK_STATE_RUNNING)
+        // Take the whole list at once. task_kill() adds to it under the scheduler lock.
+        uint32_t flags = sched_lock();
+        while(!task_zombie_list)
         {
-            asm volatile("hlt");
+            wait_queue_wait(&task_reaper_queue, 0);
+        }
+        struct task* task = task_zombie_list;
+        task_zombie_list = NULL;
+        sched_unlock(flags);
+
+        mutex_lock(&task_list_mutex);
+        while(task)
+        {
+            struct task* next = task->next;
+
+            // Its cpu may still be on its way off the stack.
+            while(task->on_cpu)
+            {
+                asm volatile("pause");
+            }
+
+            flags = sched_lock();
+            task_unregister(task);
+            sched_unlock(flags);
+
+            fpu_task_exit(task);
+            slab_free(stack_cache, (void*)task->stack_base);
+            paging_destroy_address_space(task->space);
+            slab_free(task_cache, task);
+            task = next;
         }
+        mutex_unlock(&task_list_mutex);
     }
 }
 
 //========================================================================================
-/* Round Robin scheduler function called by the timer IRQ handler. */
+/* Blocks until the task with the given id has exited. */
+void wait_for_task(uint32_t id)
+{
+    // Every exit wakes the queue. Only ours ends the wait.
+    // Once reaped, the id is gone from the hash.
+    struct task* task;
+    wait_event(&task_exit_queue, !(task = task_find(id)) || task->state == TASK_STATE_ZOMBIE);
+}
+
+//========================================================================================
+/*
+ * Priority scheduler called by the timer interrupt handlers, and by task_yield().
+ * The running task keeps the cpu until its slice runs out, it stops being runnable,
+ * or a task of a higher priority becomes runnable. Call with the scheduler lock held.
+ */
 uint32_t schedule(uint32_t current_esp)
 {
     // The PIT gets enabled before Tasking.
     if(!tasking_enabled) { return(current_esp); }
 
+    cpu_t* cpu = smp_cpu();
+    struct task* current = cpu->current;
+    uint8_t yielding = cpu->yield_requested;
+    cpu->yield_requested = 0;
+
     // Save the current task's stack.
-    if(task_table[current_task].state == TASK_STATE_RUNNING \
-    || task_table[current_task].state == TASK_STATE_SLEEPING)
+    if(current->state == TASK_STATE_RUNNING \
+    || current->state == TASK_STATE_SLEEPING \
+    || current->state == TASK_STATE_BLOCKED)
+    {
+        current->esp = current_esp;
+    }
+
+    if(current == cpu->idle)
+    {
+        // The idle task never waits in a run queue. Anyone else goes first.
+    }
+    else if(current->state == TASK_STATE_RUNNING)
+    {
+        if(current->preempt_count && !yielding)
+        {
+            // Preemption is off. preempt_enable() gives the cpu up later if it still matters.
+            if(current->slice_left == 0 \
+            || (cpu->active->bitmap && (uint8_t)__builtin_ctz(cpu->active->bitmap) < current->priority))
+            {
+                cpu->preempt_pending = 1;
+            }
+            return(current_esp);
+        }
+        else if(current->slice_left == 0)
+        {
+            // Used up its slice. It waits until everyone else had a turn.
+            task_enqueue(current);
+        }
+        else if(yielding || (cpu->active->bitmap && (uint8_t)__builtin_ctz(cpu->active->bitmap) < current->priority))
+        {
+            // Yielded or preempted. It keeps the rest of its slice.
+            task_enqueue(current);
+        }
+        else
+        {
+            return(current_esp);
+        }
+    }
+
+    // Start a new round once every active task has run its slice.
+    if(!cpu->active->bitmap)
+    {
+        run_queue_t* swap = cpu->active;
+        cpu->active = cpu->expired;
+        cpu->expired = swap;
+    }
+
+    // Our own tasks first. With none left, take one from a busy cpu, and only then idle.
+    struct task* next = run_queue_pop(cpu->active, current);
+    if(next)
+    {
+        cpu->queued--;
+    }
+    else
     {
-        task_table[current_task].esp = current_esp;
+        next = task_steal(cpu);
+        if(!next) { next = cpu->idle; }
     }
+    if(next == current) { return(current_esp); }
 
-    // Round Robin.
-    uint32_t next_task_index = current_task;
-    do {
-        next_task_index = (next_task_index + 1) % MAX_TASKS;
-    } 
-    while(task_table[next_task_index].state != TASK_STATE_RUNNING);
+    // Anyone who stopped being runnable or yielded gave the cpu up. The rest were preempted.
+    if(current->state == TASK_STATE_RUNNING && !yielding) { current->involuntary++; }
+    else                                                  { current->voluntary++; }
+    next->switches++;
+    next->last_run = task_now_ms();
 
-    // Update the current task index
-    current_task = next_task_index;
+    // Update the current task and load its address space.
+    // Its FPU registers are only loaded if it uses them.
+    // We stay on the old task's stack until the interrupt handler is done with it, and
+    // task_switch_finish() lets other cpus have it after that.
+    cpu->prev = current;
+    next->on_cpu = 1;
+    next->cpu = cpu->index;
+    cpu->current = next;
+    paging_switch_address_space(next->space);
+    fpu_switch(current, next);
 
     // Return the new task's stack pointer
-    return(task_table[current_task].esp);
+    return(next->esp);
+}
+
+//========================================================================================
+/* Called by the interrupt handlers once they are on the new task's stack. */
+void task_switch_finish()
+{
+    cpu_t* cpu = smp_cpu();
+    if(cpu->prev)
+    {
+        cpu->prev->on_cpu = 0;
+        cpu->prev = NULL;
+    }
+}
+
+//========================================================================================
+/*
+ * Gives up the cpu right away. The task stays runnable, unless it already marked itself
+ * as sleeping, blocked or a zombie. Returns once the scheduler picks it again.
+ */
+void task_yield()
+{
+    if(!tasking_enabled) { return; }
+
+    // The yield interrupt takes the same path as the timer, so the time used so far
+    // is charged and the timer is restarted for whoever runs next.
+    uint32_t ints_enabled = (EFLAGS_VALUE() & 0x200);
+    asm volatile("cli");
+    smp_cpu()->yield_requested = 1;
+    asm volatile("int %0" :: "i"(TASK_YIELD_VECTOR) : "memory");
+    if(ints_enabled) { asm volatile("sti"); }
+}
+
+//========================================================================================
+/*
+ * Keeps this cpu until the matching preempt_enable(), short of blocking or sleeping.
+ * Interrupts stay on. Other cpus are not kept out, so shared data still needs a lock. Calls nest.
+ */
+void preempt_disable()
+{
+    if(!tasking_enabled) { return; }
+    task_current()->preempt_count++;
+}
+
+//========================================================================================
+/* Undoes one preempt_disable(). Gives the cpu up if the scheduler wanted it meanwhile. */
+void preempt_enable()
+{
+    if(!tasking_enabled) { return; }
+
+    uint32_t flags = sched_lock();
+
+    cpu_t* cpu = smp_cpu();
+    struct task* current = cpu->current;
+    if(current->preempt_count) { current->preempt_count--; }
+
+    uint8_t resched = (current->preempt_count == 0 && cpu->preempt_pending);
+    if(resched) { cpu->preempt_pending = 0; }
+
+    sched_unlock(flags);
+
+    if(resched) { task_yield(); }
 }
 
 //========================================================================================
 /*
- * Marks the current task as a ZOMBIE.
- * It then spins, waiting for the scheduler (running as another task) to reap it.
+ * Marks the current task as a ZOMBIE and hands it to the reaper task.
+ * It never runs again once it gave up the cpu.
  */
 void task_kill()
 {
     // Mark ourselves as a zombie, ready for reaping.
+    // Interrupts stay off, so we can't be switched away before the reaper knows.
     asm volatile("cli");
-    task_table[current_task].state = TASK_STATE_ZOMBIE;
-    asm volatile("sti");
+    uint32_t flags = sched_lock();
+    struct task* task = smp_cpu()->current;
+    task->state = TASK_STATE_ZOMBIE;
+    task->next = task_zombie_list;
+    task_zombie_list = task;
+    sched_unlock(flags);
+
+    wait_queue_wake_one(&task_reaper_queue);
+    wait_queue_wake_all(&task_exit_queue);
 
-    // We can't return, and we can't free our own stack.
-    // So, we just spin here until the reaper frees our memory on the next tick.
+    // Hand the cpu over for good. We can't return, and we can't free our own stack.
+    task_yield();
     while(1) { asm volatile("hlt"); }
 }
 
@@ -244,13 +1121,235 @@ void task_kill()
 /* Displays a list of currently running tasks. */
 void task_list()
 {
-    for(int i=0; i<MAX_TASKS; i++)
+    kprintf("id cpu esp        stack      prio slice fpu name\n");
+
+    mutex_lock(&task_list_mutex);
+    for(struct task* task = task_list_head; task; task = task->all_next)
+    {
+        kprintf("%d  %d   0x%x 0x%x %d   %d    %c   %s\n", task->id, task->cpu, task->esp, task->stack_base, \
+            task->priority, task->time_slice, task->fpu_used ? '*' : '-', task->name);
+    }
+    mutex_unlock(&task_list_mutex);
+    fpu_display_stats();
+}
+
+//========================================================================================
+// task_display_top() shows the busiest tasks, as many as fit on the screen.
+#define TASK_TOP_ROWS   16
+
+// What it copies out of each task it shows, under the scheduler lock.
+struct task_top_row {
+    uint32_t id;
+    uint8_t  cpu;
+    uint8_t  priority;
+    uint8_t  state;
+    uint32_t recent_ms;     // Time on a cpu since the last refresh
+    uint32_t run_ticks;
+    uint32_t switches;
+    uint32_t voluntary;
+    uint32_t involuntary;
+    uint32_t sleep_ms;
+    uint32_t last_run;
+    char name[13];
+};
+
+//========================================================================================
+/* Helper: Prints a number right aligned in a column of the given width. */
+static void task_print_column(uint32_t value, uint32_t width)
+{
+    uint32_t digits = 1;
+    for(uint32_t v = value; v >= 10; v /= 10)
+    {
+        digits++;
+    }
+    for(; digits < width; digits++)
+    {
+        kprintf(" ");
+    }
+    kprintf("%d", value);
+}
+
+//========================================================================================
+/* Helper: Returns how long a task ran in total, in PIT counts. Wraps about once an hour. */
+static uint32_t task_run_counts(struct task* task)
+{
+    return((task->run_ticks * PIT_COUNTS_PER_TICK) + task->run_counts);
+}
+
+//========================================================================================
+/*
+ * Displays the tasks that used the most cpu time since the last call, and how idle the
+ * cpus were. The first call measures from boot. The shell's top command calls it once a second.
+ */
+void task_display_top()
+{
+    struct task_top_row rows[TASK_TOP_ROWS];
+    uint32_t count = 0;
+    uint32_t tasks = 0;
+    uint32_t idle_ms = 0;
+    uint32_t idle_ticks = 0;
+
+    mutex_lock(&task_list_mutex);
+    uint32_t flags = sched_lock();
+
+    uint32_t now = task_now_ms();
+    uint32_t interval = now - task_top_ms;
+    if(interval == 0) { interval = 1; }
+    task_top_ms = now;
+
+    for(struct task* task = task_list_head; task; task = task->all_next)
+    {
+        uint32_t run = task_run_counts(task);
+        uint32_t recent_ms = (run - task->top_mark) / PIT_COUNTS_PER_MS;
+        task->top_mark = run;
+        tasks++;
+
+        // The idle tasks only add up to the idle time.
+        if(task == smp_cpus[task->cpu].idle)
+        {
+            idle_ms += recent_ms;
+            idle_ticks += task->run_ticks;
+            continue;
+        }
+
+        // Keep the rows sorted, busiest first.
+        uint32_t i = (count < TASK_TOP_ROWS) ? count++ : TASK_TOP_ROWS;
+        for(; i > 0 && rows[i-1].recent_ms < recent_ms; i--)
+        {
+            if(i < TASK_TOP_ROWS) { rows[i] = rows[i-1]; }
+        }
+        if(i == TASK_TOP_ROWS) { continue; }
+
+        struct task_top_row* row = &rows[i];
+        row->id = task->id;
+        row->cpu = task->cpu;
+        row->priority = task->priority;
+        row->state = task->state;
+        row->recent_ms = recent_ms;
+        row->run_ticks = task->run_ticks;
+        row->switches = task->switches;
+        row->voluntary = task->voluntary;
+        row->involuntary = task->involuntary;
+        row->sleep_ms = task->sleep_ms;
+        row->last_run = task->on_cpu ? now : task->last_run;
+        for(int c=0; c<13; c++)
+        {
+            row->name[c] = (c < 12) ? task->name[c] : 0;
+        }
+    }
+
+    sched_unlock(flags);
+    mutex_unlock(&task_list_mutex);
+
+    // Every cpu could have run for the whole interval.
+    uint32_t capacity = interval * smp_cpu_count;
+    if(idle_ms > capacity) { idle_ms = capacity; }
+    kprintf("%d tasks, %d cpus, %d%% idle, idle for %d.%ds since boot\n", tasks, smp_cpu_count, \
+        (idle_ms * 100) / capacity, idle_ticks / 100, (idle_ticks % 100) / 10);
+
+    kprintf("  id cpu pri %%cpu time(s)  switch     vol   invol slp(s) ago(s) st name\n");
+    for(uint32_t i=0; i<count; i++)
+    {
+        struct task_top_row* row = &rows[i];
+        uint32_t percent = (row->recent_ms * 100) / interval;
+        if(percent > 100) { percent = 100; }
+
+        task_print_column(row->id, 4);
+        task_print_column(row->cpu, 4);
+        task_print_column(row->priority, 4);
+        task_print_column(percent, 5);
+        task_print_column(row->run_ticks / 100, 6);
+        kprintf(".%d", (row->run_ticks % 100) / 10);
+        task_print_column(row->switches, 8);
+        task_print_column(row->voluntary, 8);
+        task_print_column(row->involuntary, 8);
+        task_print_column(row->sleep_ms / 1000, 7);
+        task_print_column((now - row->last_run) / 1000, 7);
+        kprintf(" %c  %s\n", (row->state == TASK_STATE_RUNNING) ? 'R' : (row->state == TASK_STATE_ZOMBIE) ? 'Z' : 'S', row->name);
+    }
+}
+
+//========================================================================================
+// Context switch benchmark. Two tasks hand a turn back and forth.
+#define TASK_BENCH_ROUNDS   10000
+#define TASK_BENCH_YIELD    0   // Spin on task_yield() until it is our turn.
+#define TASK_BENCH_WAKE     1   // Block on a wait queue until the other task wakes us.
+
+static volatile uint32_t task_bench_turn;
+static volatile uint8_t  task_bench_mode;
+static volatile uint8_t  task_bench_abort;  // Set if the other player never started.
+static wait_queue_t task_bench_queue[2];
+
+//========================================================================================
+/* Helper: One side of the ping-pong. */
+static void task_bench_player(uint32_t me)
+{
+    uint32_t other = !me;
+    for(uint32_t i=0; i<TASK_BENCH_ROUNDS; i++)
+    {
+        if(task_bench_mode == TASK_BENCH_YIELD)
+        {
+            while(task_bench_turn != me && !task_bench_abort)
+            {
+                task_yield();
+            }
+            task_bench_turn = other;
+        }
+        else
+        {
+            wait_event(&task_bench_queue[me], task_bench_turn == me || task_bench_abort);
+            task_bench_turn = other;
+            wait_queue_wake_one(&task_bench_queue[other]);
+        }
+
+        if(task_bench_abort) { return; }
+    }
+}
+
+static void task_bench_ping() { task_bench_player(0); }
+static void task_bench_pong() { task_bench_player(1); }
+
+//========================================================================================
+/* Helper: Runs one ping-pong and returns the cycles it took. */
+static uint32_t task_bench_run(uint8_t mode)
+{
+    task_bench_mode = mode;
+    task_bench_turn = 0;
+    task_bench_abort = 0;
+    wait_queue_init(&task_bench_queue[0]);
+    wait_queue_init(&task_bench_queue[1]);
+
+    // Above the shell, so the two only trade the cpu with each other.
+    uint32_t start = (uint32_t)READ_TSC();
+    int ping = task_exec(task_bench_ping, "ctxbench", TASK_PRIORITY_INTERACTIVE - 1);
+    int pong = (ping < 0) ? -1 : task_exec(task_bench_pong, "ctxbench", TASK_PRIORITY_INTERACTIVE - 1);
+    if(pong < 0)
     {
-        // The name will be empty if the task was never started or it was reaped.
-        // In both cases we don't care to list it.
-        if(*task_table[i].name) 
+        kprintf("Unable to start the benchmark tasks.\n");
+        if(ping >= 0)
         {
-            kprintf("%d 0x%x 0x%x %s\n", i, task_table[i].esp, task_table[i].stack_base, task_table[i].name);
+            task_bench_abort = 1;
+            wait_queue_wake_all(&task_bench_queue[0]);
+            wait_for_task(ping);
         }
+        return(0);
     }
-}
\ No newline at end of file
+    wait_for_task(ping);
+    wait_for_task(pong);
+    return((uint32_t)READ_TSC() - start);
+}
+
+//========================================================================================
+/* Measures the ping-pong latency between two tasks, with task_yield() and with wait queues. */
+void task_benchmark()
+{
+    uint32_t switches = TASK_BENCH_ROUNDS * 2;
+    uint32_t yield_cycles = task_bench_run(TASK_BENCH_YIELD);
+    uint32_t wake_cycles = task_bench_run(TASK_BENCH_WAKE);
+    if(!yield_cycles || !wake_cycles) { return; }
+
+    kprintf("%d round trips between two tasks\n", TASK_BENCH_ROUNDS);
+    kprintf("             cycles/switch  ns/switch\n");
+    kprintf("task_yield   %d            %d\n", yield_cycles / switches, (uint32_t)clock_cycles_to_ns(yield_cycles / switches));
+    kprintf("wait queue   %d            %d\n", wake_cycles / switches, (uint32_t)clock_cycles_to_ns(wake_cycles / switches));
+}